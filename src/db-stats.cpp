@@ -50,7 +50,7 @@ bool extract_by_id(const PhonemeAlphabet& alphabet, id_t id, const string output
   w.read(alphabet.file_data_of(p));
   auto wd = w.extractByTime(p.start, p.end);
   wb.append( wd );
-  wb.build().write( output );
+  wb.write( output );
   return false;
 }
 
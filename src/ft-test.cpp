@@ -19,4 +19,38 @@ int main() {
     err += std::abs(valArr[i] - copy[i]);
   }
   std::cout << "Err: " << err << std::endl;
+
+  // Against the plain DFT, which is scaled down by T
+  double real[T];
+  for(int i = 0; i < T; i++)
+    real[i] = std::sin(0.3 * i) + 0.5 * std::cos(1.7 * i) + (i % 7) / 7.0;
+  std::complex<double> dft[T];
+  ft::FT(real, T, dft, T);
+
+  std::valarray<std::complex<double>> fromReal(T);
+  for(int i = 0; i < T; i++)
+    fromReal[i] = real[i];
+  ft::fft(fromReal);
+  double fftErr = 0;
+  for(int i = 0; i < T; i++)
+    fftErr += std::abs(fromReal[i] / (double) T - dft[i]);
+  std::cout << "FFT err: " << fftErr << std::endl;
+
+  std::complex<double> bins[T / 2 + 1];
+  ft::real_plan<double>(T).forward(real, bins);
+  double realErr = 0;
+  for(int i = 0; i <= T / 2; i++)
+    realErr += std::abs(bins[i] - fromReal[i]);
+  std::cout << "Real FFT err: " << realErr << std::endl;
+
+  // Single precision, as built with FLOAT_ANALYSIS
+  float realFloat[T];
+  for(int i = 0; i < T; i++)
+    realFloat[i] = real[i];
+  std::complex<float> floatBins[T / 2 + 1];
+  ft::real_plan<float>(T).forward(realFloat, floatBins);
+  double floatErr = 0;
+  for(int i = 0; i <= T / 2; i++)
+    floatErr += std::abs(std::complex<double>(floatBins[i]) - fromReal[i]);
+  std::cout << "Float FFT err: " << floatErr << std::endl;
 }
@@ -0,0 +1,137 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include<algorithm>
+#include<cassert>
+#include<cstddef>
+#include<cstdlib>
+#include<cstring>
+#include<type_traits>
+#include<vector>
+
+// Bump allocator for short-lived data, e.g. the temporaries of a single
+// synthesis. Nothing is freed one by one: the arena is rewound to a
+// marker or reset as a whole, and keeps its blocks for the next use.
+class Arena {
+public:
+  static constexpr size_t BLOCK_SIZE = 256 * 1024;
+
+  struct Marker {
+    size_t block;
+    size_t used;
+  };
+
+  Arena(): current(0), used(0) { }
+  Arena(const Arena&) = delete;
+  ~Arena() {
+    for(auto& b : blocks)
+      free(b.data);
+  }
+
+  void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+    while(current < blocks.size()) {
+      auto offset = (used + align - 1) & ~(align - 1);
+      if(offset + bytes <= blocks[current].size) {
+        used = offset + bytes;
+        return blocks[current].data + offset;
+      }
+      current++;
+      used = 0;
+    }
+    // malloc'd blocks are aligned for anything
+    auto size = std::max((size_t) BLOCK_SIZE, bytes);
+    blocks.push_back({ (char*) malloc(size), size });
+    current = blocks.size() - 1;
+    used = bytes;
+    return blocks[current].data;
+  }
+
+  template<class T>
+  T* allocate_array(size_t count) {
+    return (T*) allocate(count * sizeof(T), alignof(T));
+  }
+
+  template<class T>
+  T* calloc_array(size_t count) {
+    auto result = allocate_array<T>(count);
+    memset(result, 0, count * sizeof(T));
+    return result;
+  }
+
+  Marker mark() const {
+    return { current, used };
+  }
+
+  // Drops everything allocated since the marker
+  void rewind(const Marker& m) {
+    assert(m.block < current || (m.block == current && m.used <= used));
+    current = m.block;
+    used = m.used;
+  }
+
+  void reset() {
+    current = used = 0;
+  }
+
+  size_t capacity() const {
+    size_t result = 0;
+    for(auto& b : blocks)
+      result += b.size;
+    return result;
+  }
+
+private:
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  size_t current, used;
+};
+
+// Rewinds the arena to where it was when the scope was entered
+struct ArenaScope {
+  ArenaScope(Arena& arena): arena(arena), marker(arena.mark()) { }
+  ~ArenaScope() { arena.rewind(marker); }
+
+  Arena& arena;
+  Arena::Marker marker;
+};
+
+// Standard allocator on top of an arena, the heap if there's none
+template<class T>
+struct ArenaAllocator {
+  typedef T value_type;
+  // Containers follow whatever arena they are assigned from
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ArenaAllocator(Arena* arena = 0): arena(arena) { }
+  template<class U>
+  ArenaAllocator(const ArenaAllocator<U>& o): arena(o.arena) { }
+
+  Arena* arena;
+
+  T* allocate(size_t n) {
+    if(arena)
+      return arena->allocate_array<T>(n);
+    return (T*) ::operator new(n * sizeof(T));
+  }
+
+  void deallocate(T* p, size_t) {
+    if(!arena)
+      ::operator delete(p);
+  }
+
+  template<class U>
+  bool operator==(const ArenaAllocator<U>& o) const { return arena == o.arena; }
+  template<class U>
+  bool operator!=(const ArenaAllocator<U>& o) const { return arena != o.arena; }
+};
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
@@ -1,74 +1,13 @@
 #include<algorithm>
+#include<map>
+#include<memory>
 
 #include"comparisons.hpp"
-
-extern double hann(double i, int size);
+#include"speech_mod.hpp"
 
 static auto APPLY_WINDOW_CMP = true;
 static auto TIME_STEP = 0.01;
 
-typedef std::array<double, 24> CriticalBands;
-static CriticalBands toCriticalBands(const FrameFrequencies& fq, int sampleRate);
-static CriticalBands toSpectralSlopes(const CriticalBands& bands);
-
-double compare_LogSpectrum(const Wave& result, const std::vector<FrameFrequencies>& frames2,
-                           CmpValues* frameVals) {
-  auto cmp = [=](const FrameFrequencies& f1, const FrameFrequencies& f2) {
-    auto diff = 0.0;
-    for(auto i = 0u; i < f1.size(); i++) {
-      auto m1 = std::norm(f1[i]);
-      m1 = m1 ? m1 : 1;
-      auto m2 = std::norm(f2[i]);
-      m2 = m2 ? m2 : 1;
-      auto fv = std::pow( std::log10( m2 / m1), 2 );
-      diff += fv;
-    }
-    if(frameVals) frameVals->add(diff);
-    return diff;
-  };
-
-  auto frames1 = toFFTdFrames(result);
-  return compare(frames1, frames2, cmp) / frames1.size();
-}
-
-double compare_LogSpectrumCritical(const Wave& result,
-                                   const std::vector<FrameFrequencies>& frames2,
-                                   CmpValues* frameVals) {
-  auto sampleRate = result.sampleRate();
-  auto cmp = [=](const FrameFrequencies& f1, const FrameFrequencies& f2) {
-    auto bands1 = toCriticalBands(f1, sampleRate);
-    auto bands2 = toCriticalBands(f2, sampleRate);
-
-    auto diff = 0.0;
-    for(auto i = 0u; i < bands1.size(); i++)
-      diff += std::pow( std::log10(bands1[i] / bands2[i]), 2);
-    if(frameVals) frameVals->add(diff);
-    return diff;
-  };
-
-  auto frames1 = toFFTdFrames(result);
-  return compare(frames1, frames2, cmp) / frames1.size();
-}
-
-double compare_MFCC(const Wave& result, const std::vector<FrameFrequencies>& frames2,
-                    CmpValues* frameVals) {
-  auto sampleRate = result.sampleRate();
-  auto cmp = [=](const FrameFrequencies& f1, const FrameFrequencies& f2) {
-    std::array<double, 5> mfcc1, mfcc2;
-    computeMFCC(f1, mfcc1, sampleRate);
-    computeMFCC(f2, mfcc2, sampleRate);
-    auto r = 0.0;
-    for(auto i = 0u; i < mfcc1.size(); i++) {
-      auto diff = mfcc1[i] - mfcc2[i];
-      r += diff * diff;
-    }
-    if(frameVals) frameVals->add(r);
-    return r;
-  };
-
-  auto frames1 = toFFTdFrames(result);
-  return compare(frames1, frames2, cmp) / frames1.size();
-}
 
 double compare_SegSNR(const Wave& result, const Wave& original,
                       CmpValues* frameVals) {
@@ -99,108 +38,441 @@ double compare_SegSNR(const Wave& result, const Wave& original,
 //static const CriticalBands BARK_CENTERS {{ 50, 150, 250, 350, 450, 570, 700, 840, 1000, 1170, 1370, 1600, 1850, 2150, 2500, 2900, 3400, 4000, 4800, 5800, 7000, 8500, 10500, 13500 }};
 static const std::array<int, 25> BARK_BAND_EDGES {{ 0, 100, 200, 300, 400, 510, 630, 770, 920, 1080, 1270, 1480, 1720, 2000, 2320, 2700, 3150, 3700, 4400, 5300, 6400, 7700, 9500, 12000, 15500 }};
 
-static CriticalBands toCriticalBands(const FrameFrequencies& fq, int sampleRate) {
-  auto samples = fq.size();
+BarkAnalyzer::BarkAnalyzer(int sampleRate, unsigned fftSize)
+  : sampleRate(sampleRate), fftSize(fftSize) {
   auto fromHertz = [=](double hertz) {
-    return std::round(hertz * (double) samples / sampleRate);
+    return (int) std::round(hertz * (double) fftSize / sampleRate);
   };
+  // Edges are inclusive, neighbouring bands share their edge bins
+  for(auto i = 0u; i < first.size(); i++) {
+    first[i] = fromHertz(BARK_BAND_EDGES[i]);
+    last[i] = fromHertz(BARK_BAND_EDGES[i + 1]);
+    assert(first[i] >= 0 && last[i] < (int) fftSize);
+  }
+}
+
+const BarkAnalyzer& BarkAnalyzer::get(int sampleRate, unsigned fftSize) {
+  static thread_local std::map<std::pair<int, unsigned>,
+                               std::unique_ptr<BarkAnalyzer> > analyzers;
+  auto& result = analyzers[std::make_pair(sampleRate, fftSize)];
+  if(!result)
+    result.reset(new BarkAnalyzer(sampleRate, fftSize));
+  return *result;
+}
+
+void BarkAnalyzer::bands(const signal_t* power, CriticalBands& out) const {
+  for(auto i = 0u; i < out.size(); i++) {
+    signal_t sum = 0;
+    for(auto k = first[i]; k <= last[i]; k++)
+      sum += power[k];
+    out[i] = sum;
+  }
+}
+
+void BarkAnalyzer::levels(const CriticalBands& bands,
+                          CriticalBands& levels,
+                          CriticalBands& slopes,
+                          CriticalBands& weights) const {
+  const auto N = (int) bands.size();
+  for(auto i = 0; i < N; i++)
+    levels[i] = 10 * std::log10(bands[i]);
 
-  CriticalBands powers;
-  std::fill(powers.begin(), powers.end(), 0);
+  for(auto i = 1; i < N; i++)
+    slopes[i - 1] = levels[i] - levels[i - 1];
+  slopes[N - 1] = 0;
 
-  for(auto i = 0u; i < powers.size(); i++) {
-    auto botF = fromHertz(BARK_BAND_EDGES[i]),
-      topF = fromHertz(BARK_BAND_EDGES[i + 1]);
-    for(; botF <= topF; botF++) {
-      assert(botF >= 0 && botF < fq.size());
-      powers[i] += std::norm(fq[botF]);
+  auto dbMax = *std::max_element(levels.begin(), levels.end());
+  for(auto i = 0; i < N; i++) {
+    // Level of the nearest peak, uphill along the slope
+    auto peak = i;
+    if(slopes[peak] > 0) {
+      while(peak + 1 < N && slopes[peak + 1] > 0)
+        peak++;
+    } else {
+      while(peak - 1 >= 0 && slopes[peak - 1] < 0)
+        peak--;
     }
+    weights[i] = 20 / (20 + dbMax - levels[i]) * 1 / (1 + levels[peak] - levels[i]);
   }
-  return powers;
 }
 
-static CriticalBands toSpectralSlopes(const CriticalBands& bands) {
-  CriticalBands slopes;
-  slopes[slopes.size() - 1] = 0;
-  for(auto i = 1u; i < bands.size(); i++)
-    slopes[i - 1] = bands[i] - bands[i-1];
-  return slopes;
+void BarkAnalyzer::analyse(FrameAnalysis* frames, unsigned count, bool wss) const {
+  for(auto j = 0u; j < count; j++) {
+    auto& f = frames[j];
+    bands(f.power.data(), f.bands);
+    if(wss)
+      levels(f.bands, f.levels, f.slopes, f.weights);
+  }
 }
 
-static double findPeak(const CriticalBands& bands,
-                       const CriticalBands& slopes, int i) {
-  if(slopes[i] > 0) {
-    while(slopes[i + 1] > 0 && i + 1 < (int) slopes.size())
-      i++;
-  } else {
-    while(slopes[i - 1] < 0 && i - 1 >= 0)
-      i--;
+static double frame_LogSpectrum(const FrameAnalysis& f1, const FrameAnalysis& f2) {
+  auto diff = 0.0;
+  for(auto i = 0u; i < f1.power.size(); i++) {
+    auto m1 = f1.power[i];
+    m1 = m1 ? m1 : 1;
+    auto m2 = f2.power[i];
+    m2 = m2 ? m2 : 1;
+    auto fv = std::pow( std::log10( m2 / m1), 2 );
+    diff += fv;
   }
-  return bands[i];
+  return diff;
+}
+
+static double frame_LogSpectrumCritical(const FrameAnalysis& f1, const FrameAnalysis& f2) {
+  auto diff = 0.0;
+  for(auto i = 0u; i < f1.bands.size(); i++)
+    diff += std::pow( std::log10(f1.bands[i] / f2.bands[i]), 2);
+  return diff;
 }
 
-static CriticalBands computeCriticalBandWeights(const CriticalBands& bands,
-                                                const CriticalBands& slopes) {
-  CriticalBands nearestPeaks;
-  for(auto i = 0u; i < nearestPeaks.size(); i++)
-    nearestPeaks[i] = findPeak(bands, slopes, i);
-  auto dbMax = *std::max_element(bands.begin(), bands.end());
-  CriticalBands w;
-  for(auto i = 0u; i < nearestPeaks.size(); i++)
-    w[i] = 20 / (20 + dbMax - bands[i]) * 1 / (1 + nearestPeaks[i] - bands[i]);
-  return w;
+static double frame_MFCC(const FrameAnalysis& f1, const FrameAnalysis& f2) {
+  auto r = 0.0;
+  for(auto i = 0u; i < f1.mfcc.size(); i++) {
+    auto diff = f1.mfcc[i] - f2.mfcc[i];
+    r += diff * diff;
+  }
+  return r;
 }
 
 // As defined in Performance Assesment Method For Speech Enhancement Systems
+static double frame_WSS(const FrameAnalysis& f1, const FrameAnalysis& f2) {
+  auto result = 0.0;
+  for(auto i = 1u; i < f1.slopes.size(); i++)
+    result += f1.weights[i] * f2.weights[i] / 2 * std::pow(f1.slopes[i] - f2.slopes[i], 2);
+  return result;
+}
+
+unsigned spectral_metric(const std::string& name) {
+  if(name == "LogSpectrum")
+    return METRIC_LOG_SPECTRUM;
+  if(name == "LogSpectrumCritical")
+    return METRIC_LOG_SPECTRUM_CRITICAL;
+  if(name == "MFCC")
+    return METRIC_MFCC;
+  if(name == "WSS")
+    return METRIC_WSS;
+  return 0;
+}
+
+SpectralAnalysis::SpectralAnalysis(const Wave& wave, unsigned metrics, CmpValues* times)
+  : metrics(metrics) {
+  analyse(toFFTdFrames(wave, times), wave.sampleRate());
+}
+
+SpectralAnalysis::SpectralAnalysis(const std::vector<FrameFrequencies>& fft,
+                                   int sampleRate, unsigned metrics)
+  : metrics(metrics) {
+  analyse(fft, sampleRate);
+}
+
+void SpectralAnalysis::analyse(const std::vector<FrameFrequencies>& fft, int sampleRate) {
+  frames.resize(fft.size());
+  auto bark = metrics & (METRIC_LOG_SPECTRUM_CRITICAL | METRIC_WSS);
+  if(metrics & METRIC_LOG_SPECTRUM || bark)
+    for(auto j = 0u; j < fft.size(); j++)
+      power_spectrum(fft[j], frames[j].power);
+  if(bark && frames.size())
+    BarkAnalyzer::get(sampleRate, FFT_SIZE)
+      .analyse(frames.data(), frames.size(), metrics & METRIC_WSS);
+  if(metrics & METRIC_MFCC)
+    for(auto j = 0u; j < fft.size(); j++)
+      computeMFCC(fft[j], frames[j].mfcc, sampleRate);
+}
+
+void analyse_frame(const FrameFrequencies& fft, int sampleRate,
+                   unsigned metrics, FrameAnalysis& out) {
+  auto bark = metrics & (METRIC_LOG_SPECTRUM_CRITICAL | METRIC_WSS);
+  if(metrics & METRIC_LOG_SPECTRUM || bark)
+    power_spectrum(fft, out.power);
+  if(bark)
+    BarkAnalyzer::get(sampleRate, FFT_SIZE).analyse(&out, 1, metrics & METRIC_WSS);
+  if(metrics & METRIC_MFCC)
+    computeMFCC(fft, out.mfcc, sampleRate);
+}
+
+double compare_frame(const FrameAnalysis& f1, const FrameAnalysis& f2, unsigned metric) {
+  switch(metric) {
+  case METRIC_LOG_SPECTRUM:
+    return frame_LogSpectrum(f1, f2);
+  case METRIC_LOG_SPECTRUM_CRITICAL:
+    return frame_LogSpectrumCritical(f1, f2);
+  case METRIC_MFCC:
+    return frame_MFCC(f1, f2);
+  case METRIC_WSS:
+    return frame_WSS(f1, f2);
+  }
+  assert(false); // A single spectral metric
+  return 0;
+}
+
+SpectralScores compare_spectra(const SpectralAnalysis& result,
+                               const SpectralAnalysis& original,
+                               unsigned metrics,
+                               const SpectralFrameValues* frameVals) {
+  assert((result.metrics & metrics) == metrics);
+  assert((original.metrics & metrics) == metrics);
+  auto& frames1 = result.frames;
+  auto& frames2 = original.frames;
+  bool check = frames1.size() == frames2.size();
+  if(!check) {
+    ERROR("Frames: " << frames1.size() << " vs " << frames2.size());
+  }
+  assert(check);
+
+  SpectralScores scores = { 0, 0, 0, 0 };
+  auto add = [](double& total, CmpValues* values, double value) {
+    if(values) values->add(value);
+    total += value;
+  };
+  for(auto j = 0u; j < frames1.size(); j++) {
+    auto& f1 = frames1[j];
+    auto& f2 = frames2[j];
+    if(metrics & METRIC_LOG_SPECTRUM)
+      add(scores.LogSpectrum, frameVals ? frameVals->LogSpectrum : 0,
+          frame_LogSpectrum(f1, f2));
+    if(metrics & METRIC_LOG_SPECTRUM_CRITICAL)
+      add(scores.LogSpectrumCritical, frameVals ? frameVals->LogSpectrumCritical : 0,
+          frame_LogSpectrumCritical(f1, f2));
+    if(metrics & METRIC_MFCC)
+      add(scores.MFCC, frameVals ? frameVals->MFCC : 0, frame_MFCC(f1, f2));
+    if(metrics & METRIC_WSS)
+      add(scores.WSS, frameVals ? frameVals->WSS : 0, frame_WSS(f1, f2));
+  }
+
+  scores.LogSpectrum /= frames1.size();
+  scores.LogSpectrumCritical /= frames1.size();
+  scores.MFCC /= frames1.size();
+  scores.WSS /= frames1.size();
+  return scores;
+}
+
+static double compare_one(const Wave& result,
+                          const std::vector<FrameFrequencies>& frames2,
+                          CmpValues* frameVals,
+                          unsigned metric,
+                          double SpectralScores::* score,
+                          CmpValues* SpectralFrameValues::* values) {
+  SpectralAnalysis analysis(result, metric),
+    original(frames2, result.sampleRate(), metric);
+  SpectralFrameValues allValues = { 0, 0, 0, 0 };
+  allValues.*values = frameVals;
+  return compare_spectra(analysis, original, metric, &allValues).*score;
+}
+
+double compare_LogSpectrum(const Wave& result, const std::vector<FrameFrequencies>& frames2,
+                           CmpValues* frameVals) {
+  return compare_one(result, frames2, frameVals, METRIC_LOG_SPECTRUM,
+                     &SpectralScores::LogSpectrum, &SpectralFrameValues::LogSpectrum);
+}
+
+double compare_LogSpectrumCritical(const Wave& result,
+                                   const std::vector<FrameFrequencies>& frames2,
+                                   CmpValues* frameVals) {
+  return compare_one(result, frames2, frameVals, METRIC_LOG_SPECTRUM_CRITICAL,
+                     &SpectralScores::LogSpectrumCritical,
+                     &SpectralFrameValues::LogSpectrumCritical);
+}
+
+double compare_MFCC(const Wave& result, const std::vector<FrameFrequencies>& frames2,
+                    CmpValues* frameVals) {
+  return compare_one(result, frames2, frameVals, METRIC_MFCC,
+                     &SpectralScores::MFCC, &SpectralFrameValues::MFCC);
+}
+
 double compare_WSS(const Wave& result, const std::vector<FrameFrequencies>& frames2,
                    CmpValues* frameVals) {
-  auto sampleRate = result.sampleRate();
-  auto cmp = [=](const FrameFrequencies& f1, const FrameFrequencies& f2) {
-    auto bands1 = toCriticalBands(f1, sampleRate);
-    std::transform(bands1.begin(), bands1.end(), bands1.begin(), [](double d) { return 10 * std::log10(d); });
-    auto slopes1 = toSpectralSlopes(bands1);
-    auto weights1 = computeCriticalBandWeights(bands1, slopes1);
-
-    auto bands2 = toCriticalBands(f2, sampleRate);
-    std::transform(bands2.begin(), bands2.end(), bands2.begin(), [](double d) { return 10 * std::log10(d); });
-    auto slopes2 = toSpectralSlopes(bands2);
-    auto weights2 = computeCriticalBandWeights(bands2, slopes2);
-
-    auto result = 0.0;
-    for(auto i = 1u; i < slopes1.size(); i++)
-      result += weights1[i] * weights2[i] / 2 * std::pow(slopes1[i] - slopes2[i], 2);
-    if(frameVals) frameVals->add(result);
+  return compare_one(result, frames2, frameVals, METRIC_WSS,
+                     &SpectralScores::WSS, &SpectralFrameValues::WSS);
+}
+
+void toFFTdFrame(const short* samples, FrameFrequencies& values) {
+  signal_t constexpr NORM = std::numeric_limits<short>::max();
+  static const auto window = [] {
+    std::array<signal_t, FFT_SIZE> result;
+    for(auto i = 0u; i < FFT_SIZE; i++)
+      result[i] = APPLY_WINDOW_CMP ? hann(i, FFT_SIZE) : 1;
     return result;
-  };
+  }();
+  auto& plan = ft::real_plan<signal_t>(FFT_SIZE);
+  std::array<signal_t, FFT_SIZE> buffer;
+
+  for(auto i = 0u; i < buffer.size(); i++)
+    buffer[i] = samples[i] / NORM * window[i];
+
+  // Real input, the upper half mirrors the lower one
+  plan.forward(buffer.data(), values.data());
+  for(auto k = FFT_SIZE / 2 + 1; k < FFT_SIZE; k++)
+    values[k] = std::conj(values[FFT_SIZE - k]);
+}
+
+int frame_step(int sampleRate) {
+  return WaveData::toSamples(TIME_STEP, sampleRate);
+}
 
-  auto frames1 = toFFTdFrames(result);
-  return compare(frames1, frames2, cmp) / frames1.size();
+unsigned frame_count(int samples, int sampleRate) {
+  if(samples <= (int) FFT_SIZE)
+    return 0;
+  return (samples - FFT_SIZE - 1) / frame_step(sampleRate) + 1;
 }
 
 std::vector<FrameFrequencies> toFFTdFrames(const Wave& wave, CmpValues* timeVals) {
-  double constexpr NORM = std::numeric_limits<short>::max();
   std::vector<FrameFrequencies> result;
-  std::valarray<cdouble> buffer(FFT_SIZE);
 
   auto step = wave.toSamples(TIME_STEP);
   for(auto frameOffset = 0;
-      frameOffset + buffer.size() < wave.length();
+      frameOffset + FFT_SIZE < wave.length();
       frameOffset += step) {
-    WaveData frame = wave.extractBySample(frameOffset, frameOffset + buffer.size());
+    WaveData frame = wave.extractBySample(frameOffset, frameOffset + FFT_SIZE);
 
-    for(auto i = 0u; i < buffer.size(); i++) {
-      buffer[i] = frame[i] / NORM;
-      if(APPLY_WINDOW_CMP)
-        buffer[i] *= hann(i, buffer.size());
-    }
-
-    ft::fft(buffer);
-    FrameFrequencies values;
-    std::copy(std::begin(buffer), std::end(buffer), values.begin());
+    result.emplace_back();
+    toFFTdFrame(&frame[0], result.back());
 
-    result.push_back(values);
     if(timeVals) timeVals->add(wave.toDuration(frameOffset));
   }
   assert(result.size() > 0);
   return result;
 }
+
+IncrementalComparison::IncrementalComparison(const ComparisonReference& original,
+                                             int sampleRate, unsigned metric)
+  : metric(metric), sampleRate(sampleRate), original(original) {
+  assert((original.metrics & metric) == metric);
+}
+
+double IncrementalComparison::update(const WaveData& signal,
+                                     const std::vector<std::pair<int, int> >& changed) {
+  auto count = frame_count(signal.length, sampleRate);
+  auto step = frame_step(sampleRate);
+  assert(count == original.count && count > 0);
+
+  FrameFrequencies fft;
+  FrameAnalysis analysis, reference;
+  auto score = [&](unsigned j) {
+    toFFTdFrame(&signal[j * step], fft);
+    analyse_frame(fft, sampleRate, metric, analysis);
+    original.frame(j, reference);
+    values[j] = compare_frame(analysis, reference, metric);
+  };
+
+  if(values.size() != count) {
+    values.resize(count);
+    for(auto j = 0u; j < count; j++)
+      score(j);
+  } else {
+    // Ranges come in order, frames over two of them are scored once
+    auto next = 0u;
+    for(auto& range : changed) {
+      // Frame j holds samples [j * step, j * step + FFT_SIZE)
+      unsigned first = range.first <= (int) FFT_SIZE ? 0 : (range.first - (int) FFT_SIZE) / step + 1;
+      auto last = std::min(count, (unsigned) (range.second - 1) / step + 1);
+      for(auto j = std::max(first, next); j < last; j++)
+        score(j);
+      next = std::max(next, last);
+    }
+  }
+
+  // Summed in frame order, as compare_spectra does
+  double total = 0;
+  for(auto v : values)
+    total += v;
+  return total / count;
+}
+
+// Power spectra of real signals mirror around FFT_SIZE / 2
+static constexpr unsigned HALF_SPECTRUM = FFT_SIZE / 2 + 1;
+
+ComparisonReference::ComparisonReference(Wave&& signal,
+                                         const std::vector<FrameFrequencies>& frames,
+                                         int sampleRate, unsigned metrics)
+  : signal(std::move(signal)), metrics(metrics), count(metrics ? frames.size() : 0) {
+  auto offset = 0u;
+  auto part = [&](unsigned metric, unsigned size) {
+    auto result = offset;
+    if(metrics & metric)
+      offset += size;
+    return result;
+  };
+  power = part(METRIC_LOG_SPECTRUM, HALF_SPECTRUM);
+  bands = part(METRIC_LOG_SPECTRUM_CRITICAL, std::tuple_size<CriticalBands>::value);
+  mfcc = part(METRIC_MFCC, std::tuple_size<MFCCs>::value);
+  slopes = part(METRIC_WSS, std::tuple_size<CriticalBands>::value);
+  weights = part(METRIC_WSS, std::tuple_size<CriticalBands>::value);
+  stride = offset;
+
+  // Analysed a few frames at a time, the full analysis of every
+  // frame is what doesn't have to be kept
+  features.resize(count * stride);
+  const auto batch = 64u;
+  for(auto from = 0u; from < count; from += batch) {
+    std::vector<FrameFrequencies> some(frames.begin() + from,
+                                       frames.begin() + std::min(count, from + batch));
+    SpectralAnalysis analysis(some, sampleRate, metrics);
+    for(auto j = 0u; j < some.size(); j++) {
+      auto& f = analysis.frames[j];
+      auto out = &features[(from + j) * stride];
+      if(metrics & METRIC_LOG_SPECTRUM)
+        std::copy(f.power.begin(), f.power.begin() + HALF_SPECTRUM, out + power);
+      if(metrics & METRIC_LOG_SPECTRUM_CRITICAL)
+        std::copy(f.bands.begin(), f.bands.end(), out + bands);
+      if(metrics & METRIC_MFCC)
+        std::copy(f.mfcc.begin(), f.mfcc.end(), out + mfcc);
+      if(metrics & METRIC_WSS) {
+        std::copy(f.slopes.begin(), f.slopes.end(), out + slopes);
+        std::copy(f.weights.begin(), f.weights.end(), out + weights);
+      }
+    }
+  }
+  data = features.data();
+}
+
+void ComparisonReference::frame(unsigned j, FrameAnalysis& out) const {
+  assert(j < count);
+  auto in = data + j * stride;
+  if(metrics & METRIC_LOG_SPECTRUM) {
+    std::copy(in + power, in + power + HALF_SPECTRUM, out.power.begin());
+    for(auto k = HALF_SPECTRUM; k < FFT_SIZE; k++)
+      out.power[k] = out.power[FFT_SIZE - k];
+  }
+  if(metrics & METRIC_LOG_SPECTRUM_CRITICAL)
+    std::copy(in + bands, in + bands + out.bands.size(), out.bands.begin());
+  if(metrics & METRIC_MFCC)
+    std::copy(in + mfcc, in + mfcc + out.mfcc.size(), out.mfcc.begin());
+  if(metrics & METRIC_WSS) {
+    std::copy(in + slopes, in + slopes + out.slopes.size(), out.slopes.begin());
+    std::copy(in + weights, in + weights + out.weights.size(), out.weights.begin());
+  }
+}
+
+void ComparisonReference::map(const std::shared_ptr<MappedFile>& file, size_t offset) {
+  assert(file->data && offset + bytes() <= file->size);
+  assert(offset % sizeof(signal_t) == 0);
+  this->file = file;
+  data = (const signal_t*) (file->data + offset);
+  // Only the mapping is kept
+  std::vector<signal_t>().swap(features);
+}
+
+double ComparisonReference::compare(const Wave& result, const std::string& metric) const {
+  auto spectral = spectral_metric(metric);
+  if(!spectral) {
+    assert(metric == "SegSNR"); // No such metric
+    return compare_SegSNR(signal, result);
+  }
+  assert((metrics & spectral) == spectral);
+
+  SpectralAnalysis analysed(result, spectral);
+  bool check = analysed.frames.size() == count;
+  if(!check) {
+    ERROR("Frames: " << analysed.frames.size() << " vs " << count);
+  }
+  assert(check);
+
+  // Summed in frame order, as compare_spectra does
+  FrameAnalysis reference;
+  double total = 0;
+  for(auto j = 0u; j < count; j++) {
+    frame(j, reference);
+    total += compare_frame(analysed.frames[j], reference, spectral);
+  }
+  return total / count;
+}
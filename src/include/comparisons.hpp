@@ -2,14 +2,18 @@
 #define __COMPARISONS_HPP__
 
 #include<cmath>
+#include<memory>
+#include<utility>
+#include<vector>
 
 #include"wav.hpp"
 #include"fourier.hpp"
 #include"util.hpp"
 #include"libmfcc.hpp"
+#include"mfcc.hpp"
 
 constexpr size_t FFT_SIZE = 512;
-typedef std::array<cdouble, FFT_SIZE> FrameFrequencies;
+typedef std::array<std::complex<signal_t>, FFT_SIZE> FrameFrequencies;
 
 struct CmpValues {
   std::vector<double> v;
@@ -24,6 +28,99 @@ struct CmpValues {
 };
 
 std::vector<FrameFrequencies> toFFTdFrames(const Wave&, CmpValues* = 0);
+// Spectrum of the FFT_SIZE samples of a single frame, as toFFTdFrames
+void toFFTdFrame(const short* samples, FrameFrequencies&);
+// Frames toFFTdFrames takes from a signal, and how far apart they are
+unsigned frame_count(int samples, int sampleRate);
+int frame_step(int sampleRate);
+
+typedef std::array<signal_t, 24> CriticalBands;
+typedef std::array<double, 5> MFCCs;
+
+// Spectral metrics, as flags of what to analyse and compare
+enum SpectralMetric : unsigned {
+  METRIC_LOG_SPECTRUM = 1,
+  METRIC_LOG_SPECTRUM_CRITICAL = 2,
+  METRIC_MFCC = 4,
+  METRIC_WSS = 8,
+  METRIC_SPECTRAL = 15
+};
+
+// 0 for SegSNR, which works on the waveforms
+unsigned spectral_metric(const std::string& name);
+
+// What the spectral metrics need from a frame, only the parts
+// of the metrics asked for are filled in
+struct FrameAnalysis {
+  std::array<signal_t, FFT_SIZE> power;
+  CriticalBands bands;
+  // WSS: bands in dB, their slopes and weights
+  CriticalBands levels, slopes, weights;
+  MFCCs mfcc;
+};
+
+// |X|^2 of every bin, same as std::norm but over the interleaved
+// real and imaginary parts, which vectorizes
+inline void power_spectrum(const FrameFrequencies& fq, std::array<signal_t, FFT_SIZE>& out) {
+  auto data = reinterpret_cast<const signal_t*>(fq.data());
+  for(auto i = 0u; i < FFT_SIZE; i++)
+    out[i] = data[2 * i] * data[2 * i] + data[2 * i + 1] * data[2 * i + 1];
+}
+
+// Critical band analysis, the bins of every band are looked up
+// once per sample rate and FFT size
+struct BarkAnalyzer {
+  BarkAnalyzer(int sampleRate, unsigned fftSize);
+
+  // Cached per thread
+  static const BarkAnalyzer& get(int sampleRate, unsigned fftSize);
+
+  // Band powers of a power spectrum
+  void bands(const signal_t* power, CriticalBands& out) const;
+  // Band levels in dB, their slopes and WSS weights
+  void levels(const CriticalBands& bands, CriticalBands& levels,
+              CriticalBands& slopes, CriticalBands& weights) const;
+  // Bands, and levels if wss, of frames with their power filled in
+  void analyse(FrameAnalysis* frames, unsigned count, bool wss) const;
+
+  int sampleRate;
+  unsigned fftSize;
+  // First and last bin of each band, both inclusive
+  std::array<int, 24> first, last;
+};
+
+// The STFT of a signal and the features derived from it, once per signal
+// for every metric
+struct SpectralAnalysis {
+  SpectralAnalysis(const Wave&, unsigned metrics, CmpValues* times = 0);
+  SpectralAnalysis(const std::vector<FrameFrequencies>&, int sampleRate, unsigned metrics);
+
+  unsigned metrics;
+  std::vector<FrameAnalysis> frames;
+
+private:
+  void analyse(const std::vector<FrameFrequencies>&, int sampleRate);
+};
+
+// The features of one frame the metrics need
+void analyse_frame(const FrameFrequencies&, int sampleRate, unsigned metrics, FrameAnalysis&);
+// Value of a single metric for a frame of the result and one of the original
+double compare_frame(const FrameAnalysis& result, const FrameAnalysis& original, unsigned metric);
+
+struct SpectralScores {
+  double LogSpectrum, LogSpectrumCritical, MFCC, WSS;
+};
+
+// Where per frame values go, if anywhere
+struct SpectralFrameValues {
+  CmpValues *LogSpectrum, *LogSpectrumCritical, *MFCC, *WSS;
+};
+
+// All requested metrics of two analyses in one sweep over the frames
+SpectralScores compare_spectra(const SpectralAnalysis& result,
+                               const SpectralAnalysis& original,
+                               unsigned metrics,
+                               const SpectralFrameValues* = 0);
 
 double compare_LogSpectrum(const Wave&, const std::vector<FrameFrequencies>&, CmpValues* = 0);
 double compare_LogSpectrumCritical(const Wave&, const std::vector<FrameFrequencies>&, CmpValues* = 0);
@@ -31,29 +128,60 @@ double compare_MFCC(const Wave&, const std::vector<FrameFrequencies>&, CmpValues
 double compare_WSS(const Wave&, const std::vector<FrameFrequencies>&, CmpValues* = 0);
 double compare_SegSNR(const Wave& result, const Wave& original, CmpValues* = 0);
 
+// A signal many results are compared with: the waveform, and of its
+// frames only what the metrics asked for compare. Power spectra keep
+// their non-redundant half, Bark and MFCC metrics only their features.
+struct ComparisonReference {
+  ComparisonReference(Wave&& signal, const std::vector<FrameFrequencies>& frames,
+                      int sampleRate, unsigned metrics);
+
+  // Score of a metric of the result, SegSNR against the waveform
+  // and the rest against the frames
+  double compare(const Wave& result, const std::string& metric) const;
+
+  // Fills in the parts of frame j the metrics compare
+  void frame(unsigned j, FrameAnalysis& out) const;
+
+  // The features as they are, to be written out and mapped back in
+  size_t bytes() const { return count * stride * sizeof(signal_t); }
+  const char* begin() const { return (const char*) data; }
+  // Reads the features from where begin() was written to in the file
+  void map(const std::shared_ptr<MappedFile>& file, size_t offset);
+
+  Wave signal;
+  unsigned metrics, count;
+
+private:
+  // Offsets within a frame of each part, and the size of a frame
+  unsigned power, bands, mfcc, slopes, weights, stride;
+  std::vector<signal_t> features;
+  const signal_t* data;
+  std::shared_ptr<MappedFile> file;
+};
+
+// A spectral metric of a signal that changes in places, against a fixed
+// original. Only the frames over changed samples are analysed again,
+// the score is the same as the one of the whole signal.
+struct IncrementalComparison {
+  IncrementalComparison(const ComparisonReference& original,
+                        int sampleRate, unsigned metric);
+
+  // Score of the signal after the sample ranges [first, second) changed,
+  // every frame is analysed the first time
+  double update(const WaveData& signal,
+                const std::vector<std::pair<int, int> >& changed);
+
+  unsigned metric;
+  int sampleRate;
+  const ComparisonReference& original;
+  std::vector<double> values;
+};
+
 template<class Frame, class Container>
 void computeMFCC(const Frame& f, Container& h, int sampleRate) {
   double data[f.size()];
   for(auto i = 0u; i < f.size(); i++) data[i] = f[i].real();
-  for(auto i = 0u; i < h.size(); i++)
-    h[i] = GetCoefficient(data, sampleRate, 42, f.size(), i + 1);
-}
-
-template<class CMP>
-double compare(const std::vector<FrameFrequencies>& frames1,
-               const std::vector<FrameFrequencies>& frames2,
-               CMP cmp) {
-  bool check = std::abs((int) frames1.size() - (int) frames2.size()) <= 0;
-  if(!check) {
-    ERROR("Frames: " << frames1.size() << " vs " << frames2.size());
-  }
-  assert(check);
-
-  int minSize = std::min(frames1.size(), frames2.size());
-  double value = 0;
-  for(auto j = 0; j < minSize; j++)
-    value += cmp(frames1[j], frames2[j]);
-  return value;
+  MFCCExtractor::get(sampleRate, f.size(), 42).compute(data, &h[0], h.size());
 }
 
 struct Comparisons {
@@ -70,12 +198,17 @@ struct Comparisons {
   double WSS;
 
   void fill(Wave& dist, Wave& original) {
-    auto frames = toFFTdFrames(original);
-    LogSpectrum = compare_LogSpectrum(dist, frames);
-    LogSpectrumCritical = compare_LogSpectrumCritical(dist, frames);
+    SpectralAnalysis result(dist, METRIC_SPECTRAL),
+      reference(original, METRIC_SPECTRAL);
+    set(compare_spectra(result, reference, METRIC_SPECTRAL));
     SegSNR = compare_SegSNR(dist, original);
-    MFCC = compare_MFCC(dist, frames);
-    WSS = compare_WSS(dist, frames);
+  }
+
+  void set(const SpectralScores& scores) {
+    LogSpectrum = scores.LogSpectrum;
+    LogSpectrumCritical = scores.LogSpectrumCritical;
+    MFCC = scores.MFCC;
+    WSS = scores.WSS;
   }
 
   static double compare(const Wave& signal,
@@ -127,13 +260,13 @@ struct ComparisonDetails : public Comparisons {
   CmpValues times;
 
   void fill(Wave& dist, Wave& original) {
-    auto frames = toFFTdFrames(original, &times);
-    LogSpectrum = compare_LogSpectrum(dist, frames, &LogSpectrumValues);
-    LogSpectrumCritical = compare_LogSpectrumCritical(dist, frames, &LogSpectrumCriticalValues);
+    SpectralAnalysis result(dist, METRIC_SPECTRAL),
+      reference(original, METRIC_SPECTRAL, &times);
+    SpectralFrameValues values = { &LogSpectrumValues, &LogSpectrumCriticalValues,
+                                   &MFCCValues, &WSSValues };
+    set(compare_spectra(result, reference, METRIC_SPECTRAL, &values));
     SegSNR = compare_SegSNR(dist, original, &SegSNRValues);
-    MFCC = compare_MFCC(dist, frames, &MFCCValues);
-    WSS = compare_WSS(dist, frames, &WSSValues);
-  }  
+  }
 };
 
 #endif
@@ -4,6 +4,9 @@
 #include<algorithm>
 #include<cassert>
 #include<array>
+#include<cmath>
+#include<limits>
+#include<numeric>
 #include<utility>
 #include<memory>
 
@@ -26,6 +29,116 @@ class _Corpus;
 template<class CRF, class Functions>
 struct FunctionalAutomaton;
 
+// The input of a traversal, read in place instead of copied
+template<class T>
+struct InputSpan {
+  InputSpan(): data(0), length(0) { }
+  InputSpan(const vector<T>& v): data(v.data()), length(v.size()) { }
+
+  const T& operator[](size_t i) const { return data[i]; }
+  size_t size() const { return length; }
+
+  const T* data;
+  size_t length;
+};
+
+// Scratch memory of traversals, grown to the largest alphabet and input
+// seen so far and reused after that, so decoding doesn't allocate once
+// it has seen its largest sentence
+template<unsigned kBest>
+struct DecoderWorkspace {
+  typedef std::array<Transition, kBest> TrArray;
+
+  template<class T>
+  struct Buffer {
+    Buffer(): capacity(0) { }
+
+    // Contents are undefined
+    T* get(size_t size) {
+      if(size > capacity) {
+        data.reset(new T[size]);
+        capacity = size;
+      }
+      return data.get();
+    }
+
+    std::unique_ptr<T[]> data;
+    size_t capacity;
+  };
+
+  Buffer<TrArray> children, nextChildren;
+  // The best next label of every label at every position
+  Buffer<unsigned> paths;
+  // The labels allowed at a position, if the alphabet filters them
+  vector<int> allowed;
+
+  // The one of the calling thread
+  static DecoderWorkspace& local() {
+    static thread_local DecoderWorkspace workspace;
+    return workspace;
+  }
+};
+
+// log(sum(exp(v))) without overflowing, -inf for no values
+inline double log_sum_exp(const double* v, size_t n) {
+  auto max = -std::numeric_limits<double>::infinity();
+  for(auto i = 0u; i < n; i++)
+    max = std::max(max, v[i]);
+  if(std::isinf(max))
+    return max;
+  double sum = 0;
+  for(auto i = 0u; i < n; i++)
+    sum += std::exp(v[i] - max);
+  return max + std::log(sum);
+}
+
+// The candidates of every position of an input with their posteriors
+// under exp(-cost / temperature). Decoding on a lattice only goes
+// through the candidates it has, so pruned ones decode faster.
+struct Lattice {
+  vector<vector<int> > candidates;
+  vector<vector<double> > posteriors;
+  // Log of the partition function
+  double logZ = 0;
+
+  // Keeps the most probable candidates of each position until they
+  // hold mass of its posterior, at least one, in their original order
+  void prune(double mass) {
+    for(auto pos = 0u; pos < candidates.size(); pos++) {
+      auto& p = posteriors[pos];
+      vector<unsigned> order(p.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+          return p[a] > p[b];
+        });
+
+      auto kept = 0u;
+      double sum = 0;
+      while(kept < order.size() && (kept == 0 || sum < mass))
+        sum += p[order[kept++]];
+      order.resize(kept);
+      std::sort(order.begin(), order.end());
+
+      vector<int> c;
+      vector<double> q;
+      for(auto i : order) {
+        c.push_back(candidates[pos][i]);
+        q.push_back(p[i]);
+      }
+      candidates[pos].swap(c);
+      p.swap(q);
+    }
+  }
+
+  // Candidates at all positions
+  size_t size() const {
+    size_t result = 0;
+    for(auto& c : candidates)
+      result += c.size();
+    return result;
+  }
+};
+
 template<class Input, class Label>
 class _Corpus {
 public:
@@ -113,14 +226,34 @@ template<class Functions,
          class CRF,
          unsigned kBest = 1>
 std::array<cost, kBest> traverse_automaton(const vector<typename CRF::Input>& x,
-                                           CRF& crf,
+                                           const CRF& crf,
                                            const typename CRF::Values& lambda,
-                                           vector<int>* best_path) {
+                                           vector<int>* best_path,
+                                           DecoderWorkspace<kBest>* workspace = 0,
+                                           const Lattice* lattice = 0) {
   FunctionalAutomaton<CRF, Functions> a(crf);
   a.lambda = lambda;
   a.x = x;
+  a.lattice = lattice;
 
-  return a.template traverse<kBest>(best_path);
+  return a.template traverse<kBest>(best_path, workspace);
+}
+
+// Posteriors of the candidates of x, those of lattice if one is given
+template<class CRF>
+Lattice posteriors(const vector<typename CRF::Input>& x,
+                   const CRF& crf,
+                   const typename CRF::Values& lambda,
+                   double temperature = 1,
+                   const Lattice* lattice = 0) {
+  FunctionalAutomaton<CRF, MinPathFindFunctions> a(crf);
+  a.lambda = lambda;
+  a.x = x;
+  a.lattice = lattice;
+
+  Lattice result;
+  a.forward_backward(temperature, result);
+  return result;
 }
 
 template<class CRF, class Functions>
@@ -133,12 +266,20 @@ struct FunctionalAutomaton {
   const CRF& crf;
   const typename CRF::Alphabet &alphabet;
   typename CRF::Values lambda;
-  vector<typename CRF::Input> x;
+  InputSpan<typename CRF::Input> x;
+  // Restricts the candidates of each position if set
+  const Lattice* lattice = 0;
 
   int alphabet_length() {
     return alphabet.size();
   }
 
+  const vector<int>& candidates(unsigned pos, vector<int>& scratch) {
+    if(lattice)
+      return lattice->candidates[pos];
+    return alphabet.get_class(x[pos], scratch);
+  }
+
   template<bool isTransition>
   cost calculate_value(const int srcOrState,
                        const int destId,
@@ -232,7 +373,7 @@ struct FunctionalAutomaton {
                        TrArray* next_children,
                        int children_length,
                        unsigned pos,
-                       Matrix<unsigned> &paths) {
+                       unsigned* paths) {
     auto cmp = [&](const Transition& tr1, const Transition& tr2) {
       return funcs.is_better(tr1.base_value, tr2.base_value);
     };
@@ -245,7 +386,7 @@ struct FunctionalAutomaton {
                                                           srcId,
                                                           pos);
       unsigned i = 0;
-      paths(srcId, pos) = t[0].child;
+      paths[srcId * x.size() + pos] = t[0].child;
       for(auto& tr : t) {
         // The ith best path from srcId
         // passes through tr.child
@@ -258,33 +399,29 @@ struct FunctionalAutomaton {
   }
 
   template<unsigned kBestValues = 1>
-  std::array<cost, kBestValues> traverse(vector<int>* best_path) {
+  std::array<cost, kBestValues> traverse(vector<int>* best_path,
+                                         DecoderWorkspace<kBestValues>* workspace = 0) {
     static_assert(kBestValues > 0, "At least 1 best val");
     assert(x.size() > 0);
     Progress prog(x.size());
 
     typedef std::array<Transition, kBestValues> TrArray;
-    // Will need for intermediate computations
-    // std::array not considered POD on the mac...
-    TrArray* children_a = new TrArray[alphabet_length()];
-    TrArray* next_children_a = new TrArray[alphabet_length()];
-
-    TrArray* children = children_a,
-      *next_children = next_children_a;
+    auto& w = workspace ? *workspace : DecoderWorkspace<kBestValues>::local();
+    TrArray* children = w.children.get(alphabet_length()),
+      *next_children = w.nextChildren.get(alphabet_length());
 
     unsigned children_length = 0;
     unsigned next_children_length = 0;
 
     int pos = x.size() - 1;
 
-    //Matrix<std::array<unsigned, kBestPaths>> paths(alphabet_length(), x.size());
-    Matrix<unsigned> paths(alphabet_length(), x.size());
+    unsigned* paths = w.paths.get((size_t) alphabet_length() * x.size());
     
     // transitions to final state
     // value of the last "column" of states
     // meaning, if length == 1, then
     // the value will be the state cost
-    for(auto id : alphabet.get_class(x[pos])) {
+    for(auto id : candidates(pos, w.allowed)) {
       for(auto& tr : children[children_length])
         tr.set(id, funcs.empty());
       children_length++;
@@ -296,7 +433,7 @@ struct FunctionalAutomaton {
     TrArray t;
     for(; pos >= 0; pos--) {
       // for every possible label...
-      const auto& allowed = alphabet.get_class(x[pos]);
+      const auto& allowed = candidates(pos, w.allowed);
 
       next_children_length = allowed.size();
       assert(children_length > 0);
@@ -316,11 +453,12 @@ struct FunctionalAutomaton {
 
     if(best_path) {
       auto& path = *best_path;
+      path.resize(x.size());
       auto child = t[0].child;
-      path.push_back(child);
+      path[0] = child;
       for(unsigned i = 0; i < x.size() - 1; i++) {
-        child = paths(child, i);
-        path.push_back(child);
+        child = paths[child * x.size() + i];
+        path[i + 1] = child;
       }
     }
 
@@ -330,16 +468,67 @@ struct FunctionalAutomaton {
       result[i] = t.base_value;
       i++;
     }
-    delete[] children;
-    delete[] next_children;
 
     return result;
   }
+
+  // Posteriors over the lattice traverse goes through, by log-sum-exp
+  // instead of min. Transition values are computed again on the way
+  // forward rather than kept, they don't fit in memory for large classes.
+  void forward_backward(double temperature, Lattice& result) {
+    assert(x.size() > 0);
+    auto n = x.size();
+    auto scale = -1 / temperature;
+
+    vector<vector<int> > cands(n);
+    vector<int> scratch;
+    for(auto pos = 0u; pos < n; pos++) {
+      auto& c = candidates(pos, scratch);
+      cands[pos].assign(c.begin(), c.end());
+    }
+
+    // The log mass of the paths from a candidate to the end
+    vector<vector<double> > beta(n), alpha(n);
+    vector<double> scores;
+    for(auto c : cands[n - 1])
+      beta[n - 1].push_back(scale * calculate_value<false>(c, c, n - 1));
+    for(int pos = n - 2; pos >= 0; pos--) {
+      auto& next = cands[pos + 1];
+      scores.resize(next.size());
+      for(auto src : cands[pos]) {
+        for(auto m = 0u; m < next.size(); m++)
+          scores[m] = beta[pos + 1][m] + scale * calculate_value<true>(src, next[m], pos);
+        beta[pos].push_back(log_sum_exp(scores.data(), scores.size()));
+      }
+    }
+
+    // The log mass of the paths from the start to a candidate
+    alpha[0].assign(cands[0].size(), 0);
+    for(auto pos = 0u; pos + 1 < n; pos++) {
+      auto& prev = cands[pos];
+      scores.resize(prev.size());
+      for(auto dest : cands[pos + 1]) {
+        for(auto m = 0u; m < prev.size(); m++)
+          scores[m] = alpha[pos][m] + scale * calculate_value<true>(prev[m], dest, pos);
+        alpha[pos + 1].push_back(log_sum_exp(scores.data(), scores.size()));
+      }
+    }
+
+    result.logZ = log_sum_exp(beta[0].data(), beta[0].size());
+    result.posteriors.resize(n);
+    for(auto pos = 0u; pos < n; pos++) {
+      auto& p = result.posteriors[pos];
+      p.resize(cands[pos].size());
+      for(auto m = 0u; m < p.size(); m++)
+        p[m] = std::exp(alpha[pos][m] + beta[pos][m] - result.logZ);
+    }
+    result.candidates.swap(cands);
+  }
 };
 
 template<class CRF>
 cost concat_cost(const vector<typename CRF::Label>& y,
-                 CRF& crf,
+                 const CRF& crf,
                  const typename CRF::Values& lambda,
                  const vector<typename CRF::Input>& x,
                  typename CRF::Stats* stats = 0) {
@@ -357,4 +546,25 @@ cost concat_cost(const vector<typename CRF::Label>& y,
   return result;
 }
 
+// Same for a path of label ids, without copying the labels out first
+template<class CRF>
+cost concat_cost(const vector<int>& path,
+                 const CRF& crf,
+                 const typename CRF::Values& lambda,
+                 const vector<typename CRF::Input>& x,
+                 typename CRF::Stats* stats = 0) {
+  assert(x.size() > 0);
+  assert(x.size() == path.size());
+
+  FunctionalAutomaton<CRF, MinPathFindFunctions> a(crf);
+  a.lambda = lambda;
+  a.x = x;
+
+  int i = x.size() - 1;
+  cost result = a.template calculate_value<false>(path[i], path[i], i, stats);
+  for(i--; i >= 0; i--)
+    result += a.template calculate_value<true>(path[i], path[i + 1], i, stats);
+  return result;
+}
+
 #endif
@@ -1,9 +1,14 @@
 #ifndef __FOURIER_HPP__
 #define __FOURIER_HPP__
 
+#include<cassert>
 #include<complex>
 #include<cmath>
+#include<cstring>
+#include<map>
+#include<memory>
 #include<valarray>
+#include<vector>
 
 namespace ft {
   typedef std::complex<double> cdouble;
@@ -37,42 +42,168 @@ namespace ft {
     }
   }
 
+  // Two complex values side by side, re0 im0 re1 im1
+  template<class Real>
+  struct Lanes {
+    typedef Real type __attribute__((vector_size(4 * sizeof(Real))));
+  };
+
+  // Iterative in-place radix-2 FFT of a fixed size, twiddles and
+  // the bit reversal permutation are computed once per plan
+  template<class Real>
+  struct FFTPlan {
+    typedef std::complex<Real> Complex;
+    typedef typename Lanes<Real>::type Pair;
+
+    explicit FFTPlan(unsigned size)
+      : size(size), twiddles(size / 2), reversed(size),
+        stageRe(2 * size), stageIm(2 * size) {
+      assert(size && !(size & (size - 1)));
+      auto bits = 0u;
+      while((1u << bits) < size)
+        bits++;
+      for(auto i = 0u; i < size; i++) {
+        auto r = 0u;
+        for(auto b = 0u; b < bits; b++)
+          if(i & (1u << b))
+            r |= 1u << (bits - 1 - b);
+        reversed[i] = r;
+      }
+      for(auto k = 0u; k < size / 2; k++) {
+        auto t = std::polar(1.0, -2 * M_PI * k / size);
+        twiddles[k] = Complex(t.real(), t.imag());
+      }
+      // Twiddles of the stage with `half` butterflies start at 2 * half,
+      // laid out to multiply a Pair without shuffling the twiddles
+      for(auto half = 1u; half < size; half <<= 1)
+        for(auto k = 0u; k < half; k++) {
+          auto& t = twiddles[k * (size / half / 2)];
+          stageRe[2 * (half + k)] = stageRe[2 * (half + k) + 1] = t.real();
+          stageIm[2 * (half + k)] = -t.imag();
+          stageIm[2 * (half + k) + 1] = t.imag();
+        }
+    }
+
+    // Same result as fft()
+    void forward(Complex* x) const {
+      for(auto i = 0u; i < size; i++)
+        if(i < reversed[i])
+          std::swap(x[i], x[reversed[i]]);
+
+      if(size >= 2)
+        for(auto start = 0u; start < size; start += 2) {
+          auto t = x[start + 1];
+          x[start + 1] = x[start] - t;
+          x[start] += t;
+        }
+
+      // Two butterflies at once from the second stage on
+      auto data = reinterpret_cast<Real*>(x);
+      for(auto half = 2u; half < size; half <<= 1) {
+        auto re = &stageRe[2 * half], im = &stageIm[2 * half];
+        for(auto start = 0u; start < size; start += 2 * half)
+          for(auto k = 0u; k < half; k += 2) {
+            auto a = data + 2 * (start + k);
+            auto b = a + 2 * half;
+            Pair va, vb, wr, wi;
+            memcpy(&va, a, sizeof(Pair));
+            memcpy(&vb, b, sizeof(Pair));
+            memcpy(&wr, re + 2 * k, sizeof(Pair));
+            memcpy(&wi, im + 2 * k, sizeof(Pair));
+            Pair swapped = { vb[1], vb[0], vb[3], vb[2] };
+            Pair t = vb * wr + swapped * wi;
+            Pair sum = va + t, diff = va - t;
+            memcpy(a, &sum, sizeof(Pair));
+            memcpy(b, &diff, sizeof(Pair));
+          }
+      }
+    }
+
+    // Same result as ifft()
+    void inverse(Complex* x) const {
+      for(auto i = 0u; i < size; i++)
+        x[i] = std::conj(x[i]);
+      forward(x);
+      for(auto i = 0u; i < size; i++)
+        x[i] = std::conj(x[i]) / (Real) size;
+    }
+
+    unsigned size;
+    std::vector<Complex> twiddles;
+    std::vector<unsigned> reversed;
+    std::vector<Real> stageRe, stageIm;
+  };
+
+  // FFT of `size` real values through a complex one of half the size,
+  // even samples go to the real and odd ones to the imaginary parts
+  template<class Real>
+  struct RealFFTPlan {
+    typedef std::complex<Real> Complex;
+
+    explicit RealFFTPlan(unsigned size)
+      : size(size), half(size / 2), twiddles(size / 2), packed(size / 2) {
+      assert(size >= 2);
+      for(auto k = 0u; k < size / 2; k++) {
+        auto t = std::polar(1.0, -2 * M_PI * k / size);
+        twiddles[k] = Complex(t.real(), t.imag());
+      }
+    }
+
+    // Writes the size / 2 + 1 non-redundant bins, the rest are
+    // their conjugates. Not reentrant, keep a plan per thread.
+    void forward(const Real* in, Complex* out) {
+      auto N = half.size;
+      for(auto i = 0u; i < N; i++)
+        packed[i] = Complex(in[2 * i], in[2 * i + 1]);
+      half.forward(packed.data());
+
+      out[0] = Complex(packed[0].real() + packed[0].imag(), 0);
+      out[N] = Complex(packed[0].real() - packed[0].imag(), 0);
+      for(auto k = 1u; k < N; k++) {
+        auto z = packed[k], zc = std::conj(packed[N - k]);
+        auto even = (z + zc) * (Real) 0.5;
+        auto odd = (z - zc) * Complex(0, -0.5);
+        out[k] = even + twiddles[k] * odd;
+      }
+    }
+
+    unsigned size;
+    FFTPlan<Real> half;
+    std::vector<Complex> twiddles;
+    std::vector<Complex> packed;
+  };
+
+  // Plans are built once per size and thread
+  template<class Real>
+  const FFTPlan<Real>& plan(unsigned size) {
+    static thread_local std::map<unsigned, std::unique_ptr<FFTPlan<Real> > > plans;
+    auto& result = plans[size];
+    if(!result)
+      result.reset(new FFTPlan<Real>(size));
+    return *result;
+  }
+
+  template<class Real>
+  RealFFTPlan<Real>& real_plan(unsigned size) {
+    static thread_local std::map<unsigned, std::unique_ptr<RealFFTPlan<Real> > > plans;
+    auto& result = plans[size];
+    if(!result)
+      result.reset(new RealFFTPlan<Real>(size));
+    return *result;
+  }
+
+  // in-place, the size has to be a power of 2
   template<class Complex>
   void fft(std::valarray<Complex>& x) {
-    const size_t N = x.size();
-    if (N <= 1) return;
-
-    // divide
-    std::valarray<Complex> even = x[std::slice(0, N/2, 2)];
-    std::valarray<Complex>  odd = x[std::slice(1, N/2, 2)];
-
-    // conquer
-    fft(even);
-    fft(odd);
-
-    // combine
-    for (size_t k = 0; k < N/2; ++k) {
-      auto t = std::polar( (typename Complex::value_type) 1.0,
-                           (typename Complex::value_type) (-2 * M_PI * k / N)) * odd[k];
-      x[k    ] = even[k] + t;
-      x[k+N/2] = even[k] - t;
-    }
+    if(x.size() <= 1) return;
+    plan<typename Complex::value_type>(x.size()).forward(&x[0]);
   }
 
   // inverse fft (in-place)
   template<class Complex>
   void ifft(std::valarray<Complex>& x) {
-    // conjugate the complex numbers
-    x = x.apply(std::conj);
-
-    // forward fft
-    fft(x);
-
-    // conjugate the complex numbers again
-    x = x.apply(std::conj);
-
-    // scale the numbers
-    x /= x.size();
+    if(x.size() <= 1) return;
+    plan<typename Complex::value_type>(x.size()).inverse(&x[0]);
   }
 };
 
@@ -1,21 +1,48 @@
 #include<algorithm>
+#include<atomic>
 #include<chrono>
+#include<mutex>
 #include<thread>
 #include<valarray>
 #include<utility>
 #include<cmath>
 
 #include"gridsearch.hpp"
-#include"threadpool.h"
+#include"scheduler.hpp"
 #include"crf.hpp"
 #include"tool.hpp"
+#include"score_cache.hpp"
+#include"workers.hpp"
 
 using namespace gridsearch;
 
 static std::string METRIC = "MFCC";
+static ScoreCache SCORES;
 static int MAX_PER_DELTA = 20;
 static int MAX_SEARCH_ITS = 10;
 static double SEARCH_RATIO = 0.1;
+static unsigned SEARCH_POINTS = 1;
+static bool INCREMENTAL = true;
+
+// The last path synthesized and compared for a sentence, the next
+// one only costs as much as it differs from it
+struct IncrementalCompare {
+  std::mutex mutex;
+  IncrementalResynthesis synthesis;
+  std::unique_ptr<IncrementalComparison> comparison;
+};
+
+// The comparisons point into the references, so they go first
+struct gridsearch::IncrementalCompares {
+  explicit IncrementalCompares(unsigned count) {
+    for(auto i = 0u; i < count; i++)
+      states.emplace_back(new IncrementalCompare());
+  }
+
+  IncrementalCompare& operator[](unsigned index) { return *states[index]; }
+
+  std::vector<std::unique_ptr<IncrementalCompare> > states;
+};
 
 struct Range {
   Range(): Range("", 0, 0, 1) { }
@@ -41,6 +68,9 @@ struct Range {
 typedef std::array<Range, FC> Ranges;
 
 void printGridPoint(std::string file, const Params& params, const TrainingOutputs& result) {
+  // Searches along several directions at once print as well
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
   std::ofstream s(file, std::ofstream::app);
   s << "point=";
   for(auto p : params)
@@ -94,113 +124,237 @@ namespace gridsearch {
     return result;
   }
 
-  double doCompare(ResynthParams* params,
+  double doCompare(const SynthesisContext& context,
+                   ResynthParams* params,
                    const std::vector<PhonemeInstance>& input,
                    std::vector<int>& outputPath) {
     if(!params->compare)
       return 0;
     auto index = params->index;
-    std::vector<PhonemeInstance> output = crf.alphabet().to_phonemes(outputPath);
-    auto SWS = SpeechWaveSynthesis(output, input, crf.alphabet());
-    Wave resultSignal = SWS.get_resynthesis_td();
+    double score;
+    if(SCORES.find(index, outputPath, METRIC, score))
+      return score;
+
+    std::vector<PhonemeInstance> output = context.to_phonemes(outputPath);
+    auto& reference = *(*params->references)[index];
+
+    auto metric = spectral_metric(METRIC);
+    if(INCREMENTAL && metric && params->incremental) {
+      auto& state = (*params->incremental)[index];
+      // Another path of the same sentence takes the long way
+      std::unique_lock<std::mutex> lock(state.mutex, std::try_to_lock);
+      if(lock.owns_lock()) {
+        auto SWS = context.synthesis(output, input);
+        SWS.update_resynthesis_td(state.synthesis);
+        if(!state.comparison)
+          state.comparison.reset(new IncrementalComparison(reference,
+                                                           state.synthesis.sampleRate,
+                                                           metric));
+        score = state.comparison->update(state.synthesis.wave(), state.synthesis.changed);
+        SCORES.add(index, outputPath, METRIC, score);
+        return score;
+      }
+    }
 
-    auto sws2 = SpeechWaveSynthesis(input, input, alphabet_test);
-    auto originalSignal = sws2.get_concatenation();
+    auto SWS = context.synthesis(output, input, params->scheduler);
+    Wave resultSignal = SWS.get_resynthesis_td();
 
-    auto& frames = *(params->precompFrames);
+    score = reference.compare(resultSignal, METRIC);
+    SCORES.add(index, outputPath, METRIC, score);
+    return score;
+  }
 
-    return Comparisons::compare(resultSignal, originalSignal, frames[index], METRIC);
+  // Reused by every task running on this thread
+  static Arena& taskArena() {
+    static thread_local Arena arena;
+    return arena;
   }
 
   void compareOnly(ResynthParams* params) {
     auto index = params->index;
     const auto& input = corpus_test.input(index);
+    SynthesisContext context(*params->context, &taskArena());
 
     std::vector<int> output = params->result.path;
     assert(output.size());
-    params->result.cmp = doCompare(params, input, output);
-    *(params->flag) = true;
+    params->result.cmp = doCompare(context, params, input, output);
   }
 
   template<class Functions>
   void findPaths(ResynthParams* params) {
     auto index = params->index;
     const auto& input = corpus_test.input(index);
+    SynthesisContext context(*params->context, &taskArena());
     std::vector<int> path;
 
-    auto bestValues = traverse_automaton<Functions,
-                                         CRF, 2>(input, crf, crf.lambda, &path);
+    auto bestValues = context.decode<Functions, 2>(input, &path, params->lattice);
     auto cmp = 0.0;
     if(params -> compare)
-      cmp = doCompare(params, input, path);
+      cmp = doCompare(context, params, input, path);
     params->result = {
       .cmp = cmp,
       .bestValues = bestValues,
-      .path = path
+      .path = std::move(path)
     };
-    *(params->flag) = true;
   }
 
-  void wait_done(bool* flags, unsigned count) {
-    auto done = false;
-    while(!done) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      done = true;
-      for(unsigned i = 0; i < count; i++)
-        done &= flags[i];
-      DEBUG(
-            cerr << "Unfinished: ";
-            for(unsigned i = 0; i < count; i++)
-              if(!flags[i])
-                cerr << i << " ";
-            cerr << std::endl;
-            );
+  // A job of a worker: the sentences [begin, end) decoded, and compared
+  // if asked, with each of the coefficients
+  static std::string encodeJob(const std::vector<SynthesisContext>& requests,
+                               unsigned begin, unsigned end, bool compare) {
+    MessageWriter w;
+    w.put<uint32_t>(requests.size());
+    w.put<uint32_t>(begin);
+    w.put<uint32_t>(end);
+    w.put<char>(compare);
+    for(auto& request : requests)
+      w.put(request.lambda);
+    return w.data;
+  }
+
+  static void putOutput(MessageWriter& w, const TrainingOutput& output) {
+    w.put(output.cmp);
+    w.put(output.bestValues);
+    w.put<uint32_t>(output.path.size());
+    for(auto y : output.path)
+      w.put<int32_t>(y);
+  }
+
+  static TrainingOutput getOutput(MessageReader& r) {
+    TrainingOutput output;
+    output.cmp = r.get<double>();
+    output.bestValues = r.get<std::array<cost, 2> >();
+    output.path.resize(r.get<uint32_t>());
+    for(auto& y : output.path)
+      y = r.get<int32_t>();
+    return output;
+  }
+
+  // Runs in a worker, the tasks of the job one after the other
+  static std::string serveJob(const VoiceModel& model, const References& references,
+                              IncrementalCompares& incremental,
+                              const std::vector<Lattice>* lattices,
+                              const std::string& job) {
+    MessageReader r(job);
+    auto points = r.get<uint32_t>();
+    auto begin = r.get<uint32_t>(), end = r.get<uint32_t>();
+    bool compare = r.get<char>();
+
+    MessageWriter w;
+    for(auto p = 0u; p < points; p++) {
+      SynthesisContext context(model);
+      context.lambda = r.get<CRF::Values>();
+      for(auto i = begin; i < end; i++) {
+        ResynthParams params;
+        params.init(i, &context, &references, &incremental, compare);
+        if(lattices)
+          params.lattice = &(*lattices)[i];
+        findPaths<MinPathFindFunctions>(&params);
+        putOutput(w, params.result);
+      }
+    }
+    return w.data;
+  }
+
+  // Time spent waiting for batches of sentence tasks and the time the
+  // tasks took, the difference is what the threads spent idle
+  struct TaskTimes {
+    TaskTimes(): computing(0), waiting(0) { }
+
+    std::atomic<uint64_t> computing, waiting;
+  };
+  static TaskTimes TIMES;
+
+  static uint64_t microseconds(std::chrono::steady_clock::time_point since) {
+    auto elapsed = std::chrono::steady_clock::now() - since;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  }
+
+  // Only the time the training thread itself waits counts, not that of
+  // tasks waiting for tasks of their own
+  static void waitFor(Scheduler& tp, TaskGroup& group) {
+    static thread_local bool waiting = false;
+    if(waiting || tp.is_worker()) {
+      group.wait();
+      return;
     }
+    waiting = true;
+    auto start = std::chrono::steady_clock::now();
+    group.wait();
+    TIMES.waiting += microseconds(start);
+    waiting = false;
+  }
+
+  // f(i) for i in [0, count) on the scheduler, returns as soon as the
+  // last one is done
+  template<class F>
+  void runTasks(Scheduler& tp, unsigned count, const F& f) {
+    TaskGroup group(tp);
+    for(auto i = 0u; i < count; i++)
+      group.run([&f, i] {
+          auto taskStart = std::chrono::steady_clock::now();
+          f(i);
+          TIMES.computing += microseconds(taskStart);
+        });
+    waitFor(tp, group);
   }
 
-  struct FFTPrecomputeParams {
-    void init(int index, bool* flag, std::string file, std::vector< std::vector<FrameFrequencies> >* precompFrames) {
+  struct ReferencePrecomputeParams {
+    void init(int index, References* references, Scheduler* scheduler) {
       this->index = index;
-      this->flag = flag;
-      this->file = file;
-      this->precompFrames = precompFrames;
+      this->references = references;
+      this->scheduler = scheduler;
     }
 
-    std::string file;
     int index;
-    bool* flag;
 
-    std::vector< std::vector<FrameFrequencies> >* precompFrames;
+    References* references;
+    Scheduler* scheduler;
   };
 
-  void precomputeSingleFrames(FFTPrecomputeParams* params) {
-    auto SWS = SpeechWaveSynthesis(corpus_test.input(params->index),
-                                   corpus_test.input(params->index), alphabet_test);
+  void precomputeSingleReference(ReferencePrecomputeParams* params) {
+    auto& input = corpus_test.input(params->index);
+    auto SWS = SpeechWaveSynthesis(input, input, alphabet_test, &taskArena(), params->scheduler);
+    // The concatenation is what SegSNR compares with, the resynthesis
+    // to its own durations what the spectral metrics compare with
+    auto signal = SWS.get_concatenation();
     auto sourceSignal = SWS.get_resynthesis_td();
-    auto frames = toFFTdFrames(sourceSignal);
 
-    (*params->precompFrames)[params->index] = frames;
-    *(params->flag) = 1;
+    (*params->references)[params->index].reset(
+      new ComparisonReference(std::move(signal), toFFTdFrames(sourceSignal),
+                              sourceSignal.sampleRate(), spectral_metric(METRIC)));
   }
 
-  void precomputeFrames(std::vector< std::vector<FrameFrequencies> >& precompFrames,
-                        ThreadPool& tp) {
-    INFO("Precomputing FFTs");
+  void precomputeReferences(References& references, Scheduler& tp) {
+    INFO("Precomputing references");
     auto count = corpus_test.size();
-    bool flags[count];
-    std::fill(flags, flags + count, false);
-
-    auto params = new FFTPrecomputeParams[count];
-    for(auto i = 0u; i < count; i++) {
-      auto fileData = alphabet_test.file_data_of(corpus_test.input(i)[0]);
-
-      params[i].init(i, &flags[i], fileData.get_file(), &precompFrames);
+    std::vector<ReferencePrecomputeParams> params(count);
+    for(auto i = 0u; i < count; i++)
+      params[i].init(i, &references, &tp);
+    runTasks(tp, count, [&](unsigned i) { precomputeSingleReference(&params[i]); });
+  }
 
-      tp.add_task(new ParamTask<FFTPrecomputeParams>(&precomputeSingleFrames, &params[i]));
+  // Features of the references go to a file and are read back through
+  // a mapping, only the pages in use take memory
+  void spillReferences(References& references, const std::string& file) {
+    {
+      std::ofstream s(file, std::ios::binary);
+      for(auto& r : references)
+        s.write(r->begin(), r->bytes());
+      if(!s) {
+        ERROR("Can't write references to " << file);
+        return;
+      }
     }
-    wait_done(flags, count);
-
-    delete[] params;
+    auto mapped = std::make_shared<MappedFile>(file);
+    if(!mapped->data)
+      return;
+    size_t offset = 0;
+    for(auto& r : references) {
+      r->map(mapped, offset);
+      offset += r->bytes();
+    }
+    INFO("Reference features in " << file << ", " << offset << " bytes");
   }
 
   struct SearchBase {
@@ -222,21 +376,31 @@ namespace gridsearch {
 
       INFO("Searching k in " << bottom << " " << top << ":");
 
-      auto searchIn = [](double bottom, double top) {
-        return bottom + (top - bottom) * SEARCH_RATIO;
-      };
-      auto currentK = searchIn(bottom, top);
-      TrainingOutputs outputAtCurrentK;
+      // Each round tries SEARCH_POINTS points of the bracket at once, the
+      // first where a search of one point at a time goes and the others
+      // evenly over the rest. The bracket narrows to the last point the
+      // paths are the same at and the first one they change at.
       auto i = 0;
-      while (i++ < MAX_SEARCH_ITS && std::abs(top - bottom) >= Epsilon) {
-        currentK = searchIn(bottom, top);
-        outputAtCurrentK = f(current + currentK * delta, false);
+      while (i < MAX_SEARCH_ITS && std::abs(top - bottom) >= Epsilon) {
+        i++;
+        auto first = bottom + (top - bottom) * SEARCH_RATIO;
+        std::vector<double> ks;
+        std::vector<Params> points;
+        for(auto j = 0u; j < SEARCH_POINTS; j++) {
+          ks.push_back(first + (top - first) * j / SEARCH_POINTS);
+          points.push_back(current + ks.back() * delta);
+        }
 
-        if(outputAtCurrentK == outputAtCurrentParams) {
-          bottom = currentK;
+        auto outputs = f.findMinOrMax(points, findPaths<MinPathFindFunctions>, false);
+        auto changed = 0u;
+        while(changed < ks.size() && outputs[changed] == outputAtCurrentParams) {
           (std::cerr << "-").flush();
-        } else {
-          top = currentK;
+          changed++;
+        }
+        if(changed > 0)
+          bottom = ks[changed - 1];
+        if(changed < ks.size()) {
+          top = ks[changed];
           (std::cerr << "_").flush();
         }
       }
@@ -298,9 +462,18 @@ namespace gridsearch {
   };
 
   struct BruteSearch : public SearchBase {
-    BruteSearch(int maxPasses): SearchBase(), maxPasses(maxPasses) { }
+    BruteSearch(int maxPasses, bool concurrent=false, bool allAxes=false)
+      : SearchBase(), maxPasses(maxPasses), concurrent(concurrent), allAxes(allAxes) { }
 
     int maxPasses, pass = 0, nextAxis = 0;
+    // Explore the directions of a step at once, and all axes in one step
+    bool concurrent, allAxes;
+
+    // The best point the line searches along delta found
+    struct Direction {
+      Params delta, params;
+      TrainingOutputs output;
+    };
 
     template<class Function>
     cost bootstrap(Ranges& ranges, Params& current,
@@ -314,47 +487,87 @@ namespace gridsearch {
       return outputAtLastPoint.value();
     }
 
+    template<class Function>
+    static void explore(SearchBase& search, Function& f,
+                        const Params& current, Direction& d) {
+      auto newParams = current;
+      for (auto iteration = 0; iteration < MAX_PER_DELTA; iteration++) {
+        auto stepPair = search.findMinimalStep(search.outputAtLastPoint, f, d.delta, newParams);
+        auto k = stepPair.first;
+        newParams = newParams + (k * d.delta);
+
+        if(k != 0) {
+          if(d.output.value() > stepPair.second.value()) {
+            d.output = stepPair.second;
+            d.params = newParams;
+          }
+        } else {
+          break;
+        }
+      }
+    }
+
     template<class Function>
     cost nextStep(Function f, Ranges& ranges, Params& current,
                   Params& delta, Params&) {
-      auto axis = nextAxis;
-      if(axis == 0)
+      std::vector<unsigned> axes;
+      if(allAxes) {
         pass++;
+        for(auto axis = 0u; axis < ranges.size(); axis++)
+          axes.push_back(axis);
+        INFO("--- all");
+      } else {
+        auto axis = nextAxis;
+        if(axis == 0)
+          pass++;
+        nextAxis = (nextAxis + 1) % ranges.size();
+        axes.push_back(axis);
+        INFO("--- " << ranges[axis].feature);
+      }
       if(pass > maxPasses)
         stop = true;
-      nextAxis = (nextAxis + 1) % ranges.size();
-      INFO("--- " << ranges[axis].feature);
-
-      std::fill(std::begin(delta), std::end(delta), 0);
-
-      TrainingOutputs bestOutput = outputAtLastPoint;
-      auto bestParams = current;
-      auto doNextStep = [&]() {
-        auto newParams = current;
-        for (auto iteration = 0; iteration < MAX_PER_DELTA; iteration++) {
-          auto stepPair = findMinimalStep(outputAtLastPoint, f, delta, newParams);
-          auto k = stepPair.first;
-          newParams = newParams + (k * delta);
-
-          if(k != 0) {
-            if(bestOutput.value() > stepPair.second.value()) {
-              bestOutput = stepPair.second;
-              bestParams = newParams;
-            }
-          } else {
-            break;
-          }
-        }
-      };
 
-      delta[axis] = 1;
-      doNextStep();
-      delta[axis] = -1;
-      doNextStep();
+      std::vector<Direction> directions;
+      for(auto axis : axes)
+        for(auto sign : { 1, -1 }) {
+          Direction d = { ParamsFactory::make(), current, outputAtLastPoint };
+          d.delta[axis] = sign;
+          directions.push_back(d);
+        }
 
-      outputAtLastPoint = bestOutput;
-      current = bestParams;
-      return bestOutput.value();
+      // Points of all directions are given up on against the same best
+      if(f.rejection)
+        f.rejection->beginWave();
+      if(concurrent || allAxes) {
+        // Each direction starts from the outputs at current
+        std::vector<SearchBase> searches(directions.size(), *this);
+        TaskGroup group(f.tp);
+        for(auto i = 0u; i < directions.size(); i++)
+          group.run([&searches, &directions, &f, &current, i] {
+              explore(searches[i], f, current, directions[i]);
+            });
+        waitFor(f.tp, group);
+      } else {
+        for(auto& d : directions) {
+          // From the outputs at current too, not where the last one ended
+          outputAtLastPoint = d.output;
+          explore(*this, f, current, d);
+        }
+      }
+      if(f.rejection)
+        f.rejection->endWave();
+
+      // The first of the best ones, so the choice doesn't depend on
+      // which direction finished first
+      auto best = 0u;
+      for(auto i = 1u; i < directions.size(); i++)
+        if(directions[best].output.value() > directions[i].output.value())
+          best = i;
+
+      outputAtLastPoint = directions[best].output;
+      current = directions[best].params;
+      delta = directions[best].delta;
+      return outputAtLastPoint.value();
     }
   };
 
@@ -454,40 +667,93 @@ namespace gridsearch {
     return bestResult;
   }
 
+  // Requests with the coefficients of the ranges at params, the model
+  // itself never changes
+  template<class Params>
+  SynthesisContext contextAt(const VoiceModel& model, const Ranges& ranges,
+                             const CRF::Values& norms, const Params& params) {
+    SynthesisContext result(model);
+    for(auto i = 0u; i < ranges.size(); i++)
+      result.set(ranges[i].feature, params[i] / norms[i]);
+    return result;
+  }
+
+  // The candidates of each sentence holding mass of the posteriors of
+  // requests, for decodes to only go through those
+  std::shared_ptr<std::vector<Lattice> > pruneLattices(Scheduler& tp,
+                                                       const SynthesisContext& requests,
+                                                       double mass, double temperature) {
+    auto count = corpus_test.size();
+    auto result = std::make_shared<std::vector<Lattice> >(count);
+    runTasks(tp, count, [&](unsigned i) {
+        (*result)[i] = requests.posteriors(corpus_test.input(i), temperature);
+      });
+
+    size_t before = 0, after = 0;
+    for(auto& lattice : *result) {
+      before += lattice.size();
+      lattice.prune(mass);
+      after += lattice.size();
+    }
+    INFO("Pruned to " << after << " of " << before << " candidates");
+    return result;
+  }
+
   template<class Params>
   struct TrainingFunction {
-    TrainingFunction(std::vector< std::vector<FrameFrequencies> >& precomputed,
-                     ThreadPool& tp,
+    TrainingFunction(const VoiceModel& model,
+                     const References& references,
+                     IncrementalCompares& incremental,
+                     Scheduler& tp,
                      Ranges& ranges,
                      const CRF::Values& norms,
                      const Options& opts)
-      : precomputed(precomputed),
+      : model(model),
+        references(references),
+        incremental(incremental),
         tp(tp),
         ranges(ranges),
         norms(norms)
     {
       printOnly = opts.has_opt("grid-only");
       printOutput = opts.get_opt<std::string>("grid-output", "grid-output.csv");
+      if(opts.has_opt("minibatch"))
+        rejection = std::make_shared<EarlyRejection>(opts.get_opt<unsigned>("minibatch", 4),
+                                                     opts.get_opt<double>("rejection-z", 2),
+                                                     opts.get_opt<unsigned>("minibatch-seed", 1),
+                                                     corpus_test.size());
     }
 
-    std::vector< std::vector<FrameFrequencies> > & precomputed;
-    ThreadPool& tp;
+    const VoiceModel& model;
+    const References& references;
+    IncrementalCompares& incremental;
+    Scheduler& tp;
     Ranges& ranges;
     CRF::Values norms;
     bool printOnly;
     std::string printOutput;
-
-    void set_params(const Params& params) const {
-      for(auto i = 0u; i < ranges.size(); i++)
-        crf.set(ranges[i].feature, params[i] / norms[i]);
+    // Shared by the copies searches make. Pruned candidates of each
+    // sentence, if training decodes on those.
+    std::shared_ptr<std::vector<Lattice> > lattices;
+    std::shared_ptr<EarlyRejection> rejection;
+    // Decode and compare instead of the scheduler if set
+    WorkerPool* workers = 0;
+
+    SynthesisContext context(const Params& params) const {
+      return contextAt(model, ranges, norms, params);
     }
 
-    template<class TaskParams>
-    TrainingOutputs get_outputs(TaskParams& taskParams, const Params& params) const {
+    TrainingOutputs get_outputs(const ResynthParams* taskParams, unsigned count,
+                                const Params& params) const {
       TrainingOutputs outputs;
-      std::for_each(taskParams.begin(), taskParams.end(), [&](ResynthParams& p) {
+      std::for_each(taskParams, taskParams + count, [&](const ResynthParams& p) {
           outputs.push_back(p.result);
         });
+      log_outputs(outputs, params);
+      return outputs;
+    }
+
+    void log_outputs(const TrainingOutputs& outputs, const Params& params) const {
       VLOG << "Params:";
       for(auto i = 0u; i < ranges.size(); i++)
         VLOG << '\t' << ranges[i].feature << "=" << params[i];
@@ -501,53 +767,256 @@ namespace gridsearch {
         VLOG << "\t=" << to.cmp;
         VLOG << std::endl;
       }
-      return outputs;
     }
 
     TrainingOutputs compareOnlyTask(const TrainingOutputs& outputs, const Params& params) {
       auto count = outputs.size();
-      bool flags[count];
-      std::fill(flags, flags + count, 0);
+      auto requests = context(params);
       auto taskParams = std::vector<ResynthParams>(count);
       for(auto i = 0u; i < count; i++) {
-        taskParams[i].init(i, &flags[i], &precomputed, true);
+        taskParams[i].init(i, &requests, &references, &incremental, true);
+        taskParams[i].scheduler = &tp;
         taskParams[i].result.path = outputs[i].path;
-        tp.add_task(new ParamTask<ResynthParams>(compareOnly, &taskParams[i]));
       }
-      wait_done(flags, count);
-      return get_outputs(taskParams, params);
+      runTasks(tp, count, [&](unsigned i) { compareOnly(&taskParams[i]); });
+      return get_outputs(taskParams.data(), count, params);
     }
 
-    template<class Func>
-    TrainingOutputs findMinOrMax(const Params& params, Func f, bool compare=true) const {
-      set_params(params);
+    // The sentences split in one range per worker still running. Those
+    // of a worker that is gone are decoded and compared here, those of a
+    // job that crashed are decoded here and are worse than anything.
+    std::vector<TrainingOutputs> findOnWorkers(const std::vector<Params>& points,
+                                               const std::vector<SynthesisContext>& requests,
+                                               bool compare) const {
       auto count = corpus_test.size();
-      bool flags[count];
-      std::fill(flags, flags + count, 0);
-      auto taskParams = std::vector<ResynthParams>(count);
-      for(auto i = 0u; i < count; i++) {
-        taskParams[i].init(i, &flags[i], &precomputed, compare);
-        tp.add_task(new ParamTask<ResynthParams>(f, &taskParams[i]));
+      auto n = std::min(workers->size(), count);
+      auto begin = [&](unsigned w) { return count * w / n; };
+      std::vector<std::string> jobs, replies;
+      for(auto w = 0u; w < n; w++)
+        jobs.push_back(encodeJob(requests, begin(w), begin(w + 1), compare));
+      auto status = workers->run(jobs, &replies);
+
+      std::vector<TrainingOutputs> result(points.size());
+      for(auto& outputs : result)
+        outputs.resize(count);
+      std::vector<ResynthParams> local;
+      std::vector<bool> crashed;
+      for(auto w = 0u; w < n; w++) {
+        if(status[w] == WorkerPool::FAILED) {
+          ERROR("Sentences " << begin(w) << " to " << begin(w + 1) - 1
+                << " failed on worker " << w);
+        } else if(status[w] == WorkerPool::LOST) {
+          WARN("Sentences " << begin(w) << " to " << begin(w + 1) - 1
+               << " of lost worker " << w << " run here");
+        }
+        MessageReader r(replies[w]);
+        for(auto p = 0u; p < points.size(); p++)
+          for(auto i = begin(w); i < begin(w + 1); i++) {
+            if(status[w] != WorkerPool::DONE) {
+              auto lost = status[w] == WorkerPool::LOST;
+              local.emplace_back();
+              local.back().init(i, &requests[p], &references, &incremental, compare && lost);
+              local.back().scheduler = &tp;
+              if(lattices)
+                local.back().lattice = &(*lattices)[i];
+              crashed.push_back(!lost);
+              continue;
+            }
+            auto& output = result[p][i];
+            output = getOutput(r);
+            if(compare)
+              SCORES.add(i, output.path, METRIC, output.cmp);
+          }
       }
-      wait_done(flags, count);
-      return get_outputs(taskParams, params);
+
+      // Searches compare the paths, so they are needed all the same
+      runTasks(tp, local.size(), [&](unsigned j) {
+          findPaths<MinPathFindFunctions>(&local[j]);
+        });
+      for(auto j = 0u; j < local.size(); j++) {
+        auto& params = local[j];
+        auto& output = result[params.context - requests.data()][params.index];
+        output = params.result;
+        if(compare && crashed[j])
+          output.cmp = std::numeric_limits<double>::infinity();
+      }
+
+      for(auto p = 0u; p < points.size(); p++)
+        log_outputs(result[p], points[p]);
+      return result;
+    }
+
+    // The sentences at all of the points run as one batch. Workers only
+    // run findPaths, the only f searches use.
+    template<class Func>
+    std::vector<TrainingOutputs> findMinOrMax(const std::vector<Params>& points,
+                                              Func f, bool compare=true) const {
+      auto count = corpus_test.size();
+      std::vector<SynthesisContext> requests;
+      for(auto& params : points)
+        requests.push_back(context(params));
+      // Once every worker is gone it all runs here
+      if(workers && workers->size())
+        return findOnWorkers(points, requests, compare);
+      auto taskParams = std::vector<ResynthParams>(count * points.size());
+      for(auto p = 0u; p < points.size(); p++)
+        for(auto i = 0u; i < count; i++) {
+          taskParams[p * count + i].init(i, &requests[p], &references, &incremental, compare);
+          taskParams[p * count + i].scheduler = &tp;
+          if(lattices)
+            taskParams[p * count + i].lattice = &(*lattices)[i];
+        }
+      runTasks(tp, taskParams.size(), [&](unsigned i) { f(&taskParams[i]); });
+
+      std::vector<TrainingOutputs> result;
+      for(auto p = 0u; p < points.size(); p++)
+        result.push_back(get_outputs(&taskParams[p * count], count, points[p]));
+      return result;
+    }
+
+    template<class Func>
+    TrainingOutputs findMinOrMax(const Params& params, Func f, bool compare=true) const {
+      return findMinOrMax(std::vector<Params>(1, params), f, compare)[0];
+    }
+
+    cost costOf(const std::vector<int>& path, const Params& params, int index) const {
+      return context(params).concat_cost(path, corpus_test.input(index));
     }
 
-    cost costOf(const std::vector<int>& path, const Params& params, int index) {
-      auto phons = crf.alphabet().to_phonemes(path);
-      set_params(params);
-      return concat_cost<CRF>(phons, crf, crf.lambda, corpus_test.input(index));
+    // Decodes all sentences, then compares them a minibatch at a time
+    // until all are done or the point is worse than the best one
+    TrainingOutputs evaluate(const Params& params) const {
+      auto& r = *rejection;
+      auto result = findMinOrMax(params, findPaths<MinPathFindFunctions>, false);
+      auto requests = context(params);
+      auto best = r.best();
+      std::vector<double> differences;
+      r.points++;
+      for(auto start = 0u; start < r.order.size(); start += r.batch) {
+        auto end = std::min(start + r.batch, (unsigned) r.order.size());
+        auto taskParams = std::vector<ResynthParams>(end - start);
+        for(auto j = 0u; j < taskParams.size(); j++) {
+          auto i = r.order[start + j];
+          taskParams[j].init(i, &requests, &references, &incremental, true);
+          taskParams[j].scheduler = &tp;
+          taskParams[j].result.path = result[i].path;
+        }
+        runTasks(tp, taskParams.size(), [&](unsigned j) { compareOnly(&taskParams[j]); });
+
+        for(auto& p : taskParams) {
+          result[p.index].cmp = p.result.cmp;
+          if(!best.empty())
+            differences.push_back(p.result.cmp - best[p.index]);
+        }
+        r.compared += taskParams.size();
+        if(r.worse(differences)) {
+          r.rejected++;
+          result.rejected = true;
+          return result;
+        }
+      }
+      r.update(result);
+      return result;
     }
 
     TrainingOutputs operator()(const Params& params, bool compare=true) const {
-      auto result = findMinOrMax(params, findPaths<MinPathFindFunctions>, compare);
-      if(compare && printOnly) {
+      auto result = compare && rejection ?
+        evaluate(params) :
+        findMinOrMax(params, findPaths<MinPathFindFunctions>, compare);
+      if(compare && printOnly && !result.rejected) {
         printGridPoint(printOutput, params, result);
       }
       return result;
     }
   };
 
+  // Learns the coefficients from decoded paths instead of searching for
+  // them. Every sentence gets a reference path, the best by the metric
+  // of the paths decoded around the start. Each pass decodes all
+  // sentences and, for each path that isn't the reference, moves the
+  // coefficients away from its features towards those of the reference:
+  // by a step of fixed length (perceptron) or by just enough for the
+  // reference to cost less by the loss (passive-aggressive max-margin).
+  // The result is the average of the coefficients over all steps.
+  template<class Function>
+  cost structuredTraining(Function& f, Ranges& ranges, const Options& opts) {
+    auto passes = opts.get_opt<unsigned>("training-passes", 3);
+    auto acoustic = opts.has_opt("acoustic-loss");
+    auto count = corpus_test.size();
+
+    StructuredUpdate<CRF> update;
+    update.margin = opts.get_opt<std::string>("trainer", "grid") == "margin";
+    update.rate = opts.get_opt<double>("learning-rate", 0.1);
+    update.maxStep = opts.get_opt<double>("max-step", 1.0);
+    update.lossScale = opts.get_opt<double>("loss-scale", 1.0);
+    for(auto k = 0u; k < ranges.size(); k++) {
+      auto i = 0u;
+      while(i < PhoneticFeatures::Names.size() && PhoneticFeatures::Names[i] != ranges[k].feature)
+        i++;
+      assert(i < PhoneticFeatures::Names.size());
+      update.features.push_back(i);
+      update.norms.push_back(f.norms[k]);
+    }
+
+    Params current = ParamsFactory::make();
+    for(auto i = 0u; i < ranges.size(); i++)
+      current[i] = 1;
+
+    // Each coefficient a quarter and four times as large
+    std::vector<Params> points(1, current);
+    for(auto i = 0u; i < ranges.size(); i++)
+      for(auto scale : { 0.25, 4.0 }) {
+        auto p = current;
+        p[i] *= scale;
+        points.push_back(p);
+      }
+    auto candidates = f.findMinOrMax(points, findPaths<MinPathFindFunctions>, true);
+    auto references = candidates[0];
+    for(auto& outputs : candidates)
+      for(auto s = 0u; s < count; s++)
+        if(outputs[s].cmp < references[s].cmp)
+          references[s] = outputs[s];
+    LOG(" --- Value " << candidates[0].value() << ", of references " << references.value());
+
+    for(auto pass = 1u; pass <= passes; pass++) {
+      LOG(" --- Pass " << pass);
+      auto decoded = f.findMinOrMax(current, findPaths<MinPathFindFunctions>, acoustic);
+      auto mistakes = 0u;
+      for(auto s = 0u; s < count; s++) {
+        auto& yHat = decoded[s];
+        auto& y = references[s];
+        if(acoustic && yHat.cmp < y.cmp) {
+          // A better reference than the cached one
+          y = yHat;
+        } else if(yHat.path != y.path) {
+          mistakes++;
+          auto loss = 0.0;
+          if(acoustic)
+            loss = yHat.cmp - y.cmp;
+          else
+            for(auto j = 0u; j < y.path.size(); j++)
+              loss += yHat.path[j] != y.path[j];
+          auto d = update.gradient(f.model.crf, yHat.path, y.path, corpus_test.input(s));
+          update.apply(current, d,
+                       f.costOf(yHat.path, current, s) - f.costOf(y.path, current, s), loss);
+        }
+        update.add(current);
+      }
+
+      LOG(" --- " << mistakes << " of " << count << " paths not the reference");
+      for(auto i = 0u; i < ranges.size(); i++)
+        LOG(ranges[i].feature << "=" << current[i]);
+      if(mistakes == 0)
+        break;
+    }
+
+    Params average = update.average();
+    for(auto i = 0u; i < ranges.size(); i++)
+      ranges[i].current = average[i];
+    // In full, whatever the evaluation of the searches
+    return f.findMinOrMax(average, findPaths<MinPathFindFunctions>, true).value();
+  }
+
   int train(const Options& opts) {
     Progress::enabled = false;
 
@@ -555,14 +1024,16 @@ namespace gridsearch {
     MAX_PER_DELTA = opts.get_opt<unsigned>("max-per-delta", 100);
     MAX_SEARCH_ITS = opts.get_opt<unsigned>("max-search-its", 10);
     SEARCH_RATIO = opts.get_opt<double>("search-ratio", 0.1);
+    INCREMENTAL = !opts.has_opt("no-incremental");
 
-    //#pragma omp parallel for
-    ThreadPool tp(opts.get_opt<int>("thread-count", 8));
-    if (tp.initialize_threadpool() < 0) {
-      ERROR("Failed to initialize thread pool");
-      return -1;
+    auto trainer = opts.get_opt<std::string>("trainer", "grid");
+    if(trainer != "grid" && trainer != "perceptron" && trainer != "margin") {
+      ERROR("Unknown trainer " << trainer << ", not grid, perceptron or margin");
+      return 1;
     }
 
+    auto threads = opts.get_opt<unsigned>("thread-count", 8);
+
     Ranges ranges;
     if(opts.has_opt("ranges")) {
       auto names = util::split_string(opts.get_string("ranges"), ',');
@@ -591,17 +1062,80 @@ namespace gridsearch {
       norms[i++] = norm;
     }
 
-    // Pre-compute FFTd frames of source signals
-    std::vector< std::vector<FrameFrequencies> > precompFrames(corpus_test.size());
+    auto scoreCache = opts.get_opt<std::string>("score-cache", "");
+    // Scores hold for the audio the databases and synthesis flags make
+    std::stringstream scoreTag;
+    scoreTag << "databases= " << opts.synth_db << " " << opts.test_db
+             << " smooth= " << SMOOTH << " energy= " << SCALE_ENERGY
+             << " force-scale= " << FORCE_SCALE << " signal= " << sizeof(signal_t) * 8;
+    if(scoreCache != "" && SCORES.load(scoreCache, scoreTag.str())) {
+      INFO("Loaded " << SCORES.size() << " scores");
+    }
 
-    precomputeFrames(precompFrames, tp);
+    // Signals, FFTd frames and features of the test sentences
+    References references(corpus_test.size());
+
+    // Read by every task, crf isn't changed while training
+    VoiceModel model(crf);
+    // Shared by every decode, workers included
+    std::shared_ptr<std::vector<Lattice> > lattices;
+
+    {
+      // Its threads are gone before workers are forked
+      Scheduler precompute(threads);
+      precomputeReferences(references, precompute);
+      if(opts.has_opt("prune-mass")) {
+        Params start = ParamsFactory::make();
+        for(auto i = 0u; i < ranges.size(); i++)
+          start[i] = 1;
+        lattices = pruneLattices(precompute, contextAt(model, ranges, norms, start),
+                                 opts.get_opt<double>("prune-mass", 1),
+                                 opts.get_opt<double>("posterior-temperature", 1));
+      }
+    }
+    auto spill = opts.get_opt<std::string>("reference-spill", "");
+    if(spill != "")
+      spillReferences(references, spill);
     INFO("Done");
 
-    auto Function = TrainingFunction<Params>(precompFrames, tp, ranges, norms, opts);
+    // Declared after the references it points into, so it goes first
+    IncrementalCompares incremental(corpus_test.size());
 
-    auto searchAlgo = BruteSearch(opts.get_opt<unsigned>("training-passes", 3));
+    // Processes sharing the databases and references loaded so far
+    std::unique_ptr<WorkerPool> workers;
+    if(opts.has_opt("workers"))
+      workers.reset(new WorkerPool(opts.get_opt<unsigned>("workers", 2),
+                                   [&](const std::string& job) {
+                                     return serveJob(model, references, incremental,
+                                                     lattices.get(), job);
+                                   }));
+
+    //#pragma omp parallel for
+    Scheduler tp(threads);
+    // Points of a line search tried at once, enough to keep the cores
+    // busy with the sentences of all of them. More narrow the bracket
+    // further each round, but each one decodes every sentence.
+    auto sentences = std::max(1u, (unsigned) corpus_test.size());
+    auto cores = std::min(tp.size(), std::max(1u, std::thread::hardware_concurrency()));
+    if(workers)
+      cores = std::max(cores, workers->size());
+    SEARCH_POINTS = std::max(1u, opts.get_opt<unsigned>("search-points",
+                                                        (cores + sentences - 1) / sentences));
+
+    auto Function = TrainingFunction<Params>(model, references, incremental, tp, ranges,
+                                             norms, opts);
+    Function.workers = workers.get();
+    Function.lattices = lattices;
+
+    auto searchAlgo = BruteSearch(opts.get_opt<unsigned>("training-passes", 3),
+                                  opts.has_opt("explore-directions"),
+                                  opts.has_opt("explore-axes"));
     //auto searchAlgo = DescentSearch();
-    if(!opts.has_opt("grid-input")) {
+
+    if(trainer == "perceptron" || trainer == "margin") {
+      auto result = structuredTraining(Function, ranges, opts);
+      INFO("Value: " << result);
+    } else if(!opts.has_opt("grid-input")) {
       auto result = descentSearch(searchAlgo, Function, ranges,
                                   opts.get_opt<int>("max-iterations", 9999999));
       INFO("Value: " << result);
@@ -630,6 +1164,19 @@ namespace gridsearch {
       }
     }
 
+    if(Function.rejection) {
+      auto& r = *Function.rejection;
+      INFO("Rejected " << r.rejected << " of " << r.points << " points early, compared "
+           << r.compared << " of " << (uint64_t) r.points * corpus_test.size() << " sentences");
+    }
+    INFO("Scores cached: " << SCORES.hits << " hits, " << SCORES.misses << " misses");
+    auto waiting = TIMES.waiting / 1e6, computing = TIMES.computing / 1e6;
+    INFO("Waited " << waiting << " s for tasks taking " << computing << " s, "
+         << (int) (100 * computing / std::max(waiting * tp.size(), 1e-9)) << "% of "
+         << tp.size() << " threads busy");
+    if(scoreCache != "")
+      SCORES.save(scoreCache, scoreTag.str());
+
     INFO("Best at: ");
     for(auto& r : ranges)
       LOG(r.feature << "=" << r.current);
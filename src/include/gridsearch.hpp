@@ -1,13 +1,23 @@
 #ifndef __GRID_SEARCH_HPP__
 #define __GRID_SEARCH_HPP__
 
+#include<algorithm>
+#include<atomic>
 #include<cassert>
+#include<cmath>
+#include<cstdint>
+#include<limits>
+#include<memory>
+#include<mutex>
+#include<numeric>
+#include<random>
 #include<utility>
 
 #include"options.hpp"
 #include"speech_mod.hpp"
 #include"comparisons.hpp"
 #include"features.hpp"
+#include"voice_model.hpp"
 
 namespace gridsearch {
 
@@ -35,7 +45,13 @@ namespace gridsearch {
   };
 
   struct TrainingOutputs : public std::vector<TrainingOutput> {
+    // Given up on before all sentences were compared, worse than any
+    // point that was compared in full
+    bool rejected = false;
+
     cost value() const {
+      if(rejected)
+        return std::numeric_limits<cost>::infinity();
       std::vector<double> comps;
       for(auto& output : (*this))
         comps.push_back(output.cmp);
@@ -63,21 +79,37 @@ namespace gridsearch {
     }
   };
 
+  // One per test sentence, built before training starts
+  typedef std::vector<std::unique_ptr<ComparisonReference> > References;
+  // What was last synthesized and compared for each sentence
+  struct IncrementalCompares;
+
   struct ResynthParams {
-    void init(int index, bool* flag,
-              std::vector< std::vector<FrameFrequencies> >* precomputed,
+    void init(int index,
+              const SynthesisContext* context,
+              const References* references,
+              IncrementalCompares* incremental,
               bool compare=true) {
       this->index = index;
-      this->flag = flag;
-      this->precompFrames = precomputed;
+      this->context = context;
+      this->references = references;
+      this->incremental = incremental;
       this->compare = compare;
+      this->lattice = 0;
+      this->scheduler = 0;
     }
 
     int index;
-    bool* flag;
-    std::vector< std::vector<FrameFrequencies> >* precompFrames;
+    // Shared by the tasks of a batch, each one works on a copy
+    const SynthesisContext* context;
+    const References* references;
+    IncrementalCompares* incremental;
     TrainingOutput result;
     bool compare;
+    // Pruned candidates of the sentence, decodes go through all if 0
+    const Lattice* lattice;
+    // Full resyntheses of the task overlap-add their units on it if set
+    Scheduler* scheduler;
   };
 
   std::string to_text_string(const std::vector<PhonemeInstance>& vec);
@@ -91,6 +123,167 @@ namespace gridsearch {
     }
   };
   typedef std::vector< std::pair<Params, TrainingOutputs> > GridPoints;
+
+  // Compares the sentences of a point a minibatch at a time, in an order
+  // shuffled once so every point sees the same sentences first. A point
+  // is given up on as soon as it is worse than the best one on the
+  // sentences compared so far, by more than z standard errors of their
+  // differences. The others are compared in full.
+  struct EarlyRejection {
+    EarlyRejection(unsigned batch, double z, unsigned seed, unsigned count)
+      : batch(std::max(1u, batch)), z(z), order(count),
+        incumbent(std::numeric_limits<cost>::infinity()),
+        wave(false), waveBest(std::numeric_limits<cost>::infinity()),
+        points(0), rejected(0), compared(0) {
+      std::iota(order.begin(), order.end(), 0);
+      std::mt19937 random(seed);
+      std::shuffle(order.begin(), order.end(), random);
+    }
+
+    // Whether a point is worse than the best by the differences of its
+    // values on the sentences compared so far
+    bool worse(const std::vector<double>& differences) const {
+      auto n = differences.size();
+      if(n < 2 || n >= order.size())
+        return false;
+      auto mean = std::accumulate(differences.begin(), differences.end(), 0.0) / n;
+      auto variance = 0.0;
+      for(auto d : differences)
+        variance += (d - mean) * (d - mean);
+      variance /= n - 1;
+      // Sampled without replacement, the fewer are left the less they vary
+      auto error = std::sqrt(variance / n * (1 - (double) n / order.size()));
+      return mean - z * error > 0;
+    }
+
+    // The values of the sentences at the best point, none before there is one
+    std::vector<double> best() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return values;
+    }
+
+    void update(const TrainingOutputs& outputs) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<double> candidate;
+      for(auto& output : outputs)
+        candidate.push_back(output.cmp);
+      auto value = outputs.value();
+      auto& best = wave ? waveBest : incumbent;
+      auto& bestValues = wave ? waveValues : values;
+      // Ties go the same way whichever came first
+      if(value > best || (value == best && !(candidate < bestValues)))
+        return;
+      best = value;
+      bestValues.swap(candidate);
+    }
+
+    // Points evaluated from beginWave to endWave are all compared with
+    // the best point before the wave, the best of them only counts after
+    // it. Searches running at once then give up on the same points
+    // whatever order they finish in.
+    void beginWave() {
+      std::lock_guard<std::mutex> lock(mutex);
+      wave = true;
+    }
+
+    void endWave() {
+      std::lock_guard<std::mutex> lock(mutex);
+      wave = false;
+      if(waveBest < incumbent) {
+        incumbent = waveBest;
+        values.swap(waveValues);
+      }
+      waveBest = std::numeric_limits<cost>::infinity();
+      waveValues.clear();
+    }
+
+    unsigned batch;
+    double z;
+    std::vector<unsigned> order;
+    std::mutex mutex;
+    cost incumbent;
+    std::vector<double> values;
+    bool wave;
+    cost waveBest;
+    std::vector<double> waveValues;
+    std::atomic<unsigned> points, rejected;
+    std::atomic<uint64_t> compared;
+  };
+
+  // Unweighted feature sums of a path, concat_cost keeps the values of
+  // each position in its stats
+  template<class CRF>
+  typename CRF::Values pathFeatures(const CRF& crf, const std::vector<int>& path,
+                                    const std::vector<typename CRF::Input>& input) {
+    auto unweighted = crf.lambda;
+    unweighted.fill(1);
+    typename CRF::Stats stats;
+    concat_cost<CRF>(path, crf, unweighted, input, &stats);
+
+    typename CRF::Values result;
+    result.fill(0);
+    for(auto& values : stats)
+      for(auto i = 0u; i < result.size(); i++)
+        result[i] += values[i];
+    return result;
+  }
+
+  // The step of the structured trainers for a sentence decoded to a
+  // path other than its reference. Coefficient features[i] of the CRF
+  // is params[i] / norms[i].
+  template<class CRF>
+  struct StructuredUpdate {
+    // How the cost of yHat minus the one of y changes with the params
+    Params gradient(const CRF& crf, const std::vector<int>& yHat, const std::vector<int>& y,
+                    const std::vector<typename CRF::Input>& input) const {
+      auto a = pathFeatures(crf, yHat, input), b = pathFeatures(crf, y, input);
+      Params result(features.size());
+      for(auto i = 0u; i < features.size(); i++)
+        result[i] = (a[features[i]] - b[features[i]]) / norms[i];
+      return result;
+    }
+
+    // Moves params along d, the gradient, for the reference to cost
+    // less. By rate (perceptron) or by just enough for the difference
+    // of the costs to become lossScale * loss, at most maxStep along d
+    // (passive-aggressive max-margin). None of them goes below 0.
+    void apply(Params& params, const Params& d, cost difference, double loss) const {
+      auto norm2 = (d * d).sum();
+      if(norm2 <= 0)
+        return;
+      double step;
+      if(margin) {
+        auto violation = lossScale * loss - difference;
+        step = std::min(maxStep, std::max(0.0, violation / norm2));
+      } else {
+        step = rate / std::sqrt(norm2);
+      }
+      for(auto i = 0u; i < params.size(); i++)
+        params[i] = std::max(0.0, params[i] + step * d[i]);
+    }
+
+    // The result is the average of the params after every sentence
+    void add(const Params& params) {
+      if(steps++ == 0)
+        sum = params;
+      else
+        sum += params;
+    }
+
+    // All 0 before the first sentence
+    Params average() const {
+      if(steps == 0)
+        return Params(0.0, features.size());
+      return sum / (double) steps;
+    }
+
+    std::vector<unsigned> features;
+    std::vector<double> norms;
+    bool margin;
+    double rate, maxStep, lossScale;
+    Params sum;
+    unsigned steps = 0;
+  };
 }
 
 #endif
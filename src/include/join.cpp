@@ -0,0 +1,202 @@
+#include<algorithm>
+#include<cmath>
+
+#include"join.hpp"
+#include"speech_mod.hpp"
+
+static double toMel(double f) {
+  return 2595 * std::log10(1 + f / 700);
+}
+
+static double fromMel(double m) {
+  return 700 * (std::pow(10, m / 2595) - 1);
+}
+
+static unsigned fftSizeFor(unsigned samples) {
+  auto result = 1u;
+  while(result < samples)
+    result <<= 1;
+  return result;
+}
+
+JoinOptimizer::JoinOptimizer(unsigned sampleRate, bool xcorr)
+  : sampleRate(sampleRate), xcorr(xcorr),
+    plan(FRAME), xcorrPlan(fftSizeFor(FRAME + 2 * MAX_LAG)),
+    bands(BANDS), buffer(FRAME / 2 + 1), reference(xcorrPlan.size) {
+  for(auto i = 0; i < FRAME; i++)
+    window[i] = hann(i, FRAME);
+
+  // Triangles equally spaced on the mel scale, each one only keeps
+  // the weights of the bins it covers
+  double edges[BANDS + 2];
+  auto maxMel = toMel(sampleRate / 2.0);
+  for(auto i = 0; i < BANDS + 2; i++)
+    edges[i] = fromMel(maxMel * i / (BANDS + 1));
+
+  for(auto b = 0; b < BANDS; b++) {
+    auto& band = bands[b];
+    band.first = -1;
+    for(auto k = 0; k <= FRAME / 2; k++) {
+      double f = k * (double) sampleRate / FRAME;
+      double weight = 0;
+      if(f > edges[b] && f <= edges[b + 1])
+        weight = (f - edges[b]) / (edges[b + 1] - edges[b]);
+      else if(f > edges[b + 1] && f < edges[b + 2])
+        weight = (edges[b + 2] - f) / (edges[b + 2] - edges[b + 1]);
+      if(weight <= 0)
+        continue;
+      if(band.first < 0)
+        band.first = k;
+      band.weights.resize(k - band.first + 1);
+      band.weights[k - band.first] = weight;
+    }
+    if(band.first < 0)
+      band.first = 0;
+  }
+
+  // c0 is the frame energy, left out on purpose
+  for(auto c = 0; c < CEPSTRA; c++)
+    for(auto b = 0; b < BANDS; b++)
+      dct[c][b] = std::cos(M_PI * (c + 1) * (b + 0.5) / BANDS);
+}
+
+void JoinOptimizer::analyse(const SpeechWaveData& w, int from, int count,
+                            Features* out) {
+  float mel[BANDS];
+  for(auto k = 0; k < count; k++) {
+    auto start = from + k * HOP;
+    for(auto t = 0; t < FRAME; t++)
+      frame[t] = w[start + t] * window[t];
+    plan.forward(frame.data(), buffer.data());
+
+    for(auto b = 0; b < BANDS; b++) {
+      auto& band = bands[b];
+      float energy = 0;
+      for(auto i = 0u; i < band.weights.size(); i++)
+        energy += band.weights[i] * std::norm(buffer[band.first + i]);
+      mel[b] = std::log(energy + 1);
+    }
+
+    for(auto c = 0; c < CEPSTRA; c++) {
+      float value = 0;
+      for(auto b = 0; b < BANDS; b++)
+        value += dct[c][b] * mel[b];
+      out[k][c] = value;
+    }
+  }
+}
+
+int JoinOptimizer::align(const SpeechWaveData& p, int cut,
+                         const SpeechWaveData& n, int start,
+                         int minLag, int maxLag) {
+  auto N = xcorrPlan.size;
+  auto lags = maxLag - minLag + 1;
+  auto searched = FRAME + lags - 1;
+  assert(searched <= (int) N);
+
+  std::vector<Complex> search(N);
+  std::fill(reference.begin(), reference.end(), Complex(0, 0));
+  for(auto t = 0; t < FRAME; t++)
+    reference[t] = Complex(p[cut + t], 0);
+  for(auto t = 0; t < searched; t++)
+    search[t] = Complex(n[start + minLag + t], 0);
+
+  xcorrPlan.forward(reference.data());
+  xcorrPlan.forward(search.data());
+  for(auto i = 0u; i < N; i++)
+    search[i] *= std::conj(reference[i]);
+  xcorrPlan.inverse(search.data());
+
+  // Normalised by the energy of the part of n under the reference,
+  // the energy of the reference itself is the same for every lag
+  double energy = 0;
+  for(auto t = 0; t < FRAME; t++)
+    energy += (double) n[start + minLag + t] * n[start + minLag + t];
+
+  auto best = 0;
+  auto bestValue = -INFINITY;
+  for(auto j = 0; j < lags; j++) {
+    if(j > 0) {
+      double leaving = n[start + minLag + j - 1];
+      double entering = n[start + minLag + j + FRAME - 1];
+      energy += entering * entering - leaving * leaving;
+    }
+    auto value = search[j].real() / std::sqrt(std::max(energy, 1.0));
+    if(value > bestValue) {
+      bestValue = value;
+      best = j;
+    }
+  }
+  return minLag + best;
+}
+
+int JoinOptimizer::couple(SpeechWaveData& p, SpeechWaveData& n) {
+  // A candidate cut at `offset` compares what follows it in p with what
+  // follows it in n, both frames have to stay within the extra data
+  auto pExtraEnd = p.extra.offset + p.extra.length - p.offset;
+  auto nExtraEnd = n.extra.offset + n.extra.length - n.offset;
+  auto maxOffset = std::min({ pExtraEnd - p.length - FRAME,
+                              nExtraEnd - FRAME,
+                              n.length / 2 });
+  auto minOffset = std::max(-p.length / 2,
+                            n.extra.offset - n.offset);
+  if(minOffset > 0 || maxOffset < 0)
+    return 0;
+
+  auto count = (maxOffset - minOffset) / HOP + 1;
+  pFeatures.resize(count + 1);
+  nFeatures.resize(count + 1);
+  analyse(p, p.length + minOffset, count, pFeatures.data());
+  analyse(n, minOffset, count, nFeatures.data());
+  // Keeping the cut where it is
+  analyse(p, p.length, 1, &pFeatures[count]);
+  analyse(n, 0, 1, &nFeatures[count]);
+
+  auto distance = [&](int k) {
+    float result = 0;
+    for(auto c = 0; c < CEPSTRA; c++) {
+      auto diff = pFeatures[k][c] - nFeatures[k][c];
+      result += diff * diff;
+    }
+    return result;
+  };
+
+  auto minDiff = distance(count);
+  auto minOffsetFound = 0;
+  for(auto k = 0; k < count; k++) {
+    auto diff = distance(k);
+    if(diff < minDiff) {
+      minDiff = diff;
+      minOffsetFound = minOffset + k * HOP;
+    }
+  }
+
+  auto lag = 0;
+  if(xcorr) {
+    // n keeps its new length, so its end moves by the lag as well
+    auto minLag = std::max(-MAX_LAG, n.extra.offset - n.offset - minOffsetFound);
+    auto maxLag = std::min({ MAX_LAG,
+                             nExtraEnd - n.length,
+                             nExtraEnd - minOffsetFound - FRAME });
+    if(minLag < maxLag)
+      lag = align(p, p.length + minOffsetFound, n, minOffsetFound, minLag, maxLag);
+  }
+
+  auto preDuration = p.duration() + n.duration();
+
+  p.length += minOffsetFound;
+  n.offset += minOffsetFound + lag;
+  n.length -= minOffsetFound;
+
+  auto postDuration = p.duration() + n.duration();
+
+  assert(p.length > 0);
+  assert(p.offset >= 0);
+  assert(n.length > 0);
+  assert(n.offset >= 0);
+  // Due to double-rounding errors, it's possible that
+  // they differ as time points, but not as samples...
+  assert(p.toSamples(preDuration - postDuration) == 0);
+
+  return minOffsetFound;
+}
@@ -0,0 +1,57 @@
+#ifndef __JOIN_HPP__
+#define __JOIN_HPP__
+
+#include<array>
+#include<complex>
+#include<vector>
+
+#include"wav.hpp"
+#include"fourier.hpp"
+
+// Picks where two consecutive units are cut. Candidate cuts are hops of
+// one STFT over each boundary region, every hop is reduced to a few
+// mel cepstra once and the candidates compare those. Optionally the
+// start of the next unit is then aligned to the waveform before the cut
+// by cross-correlation.
+struct JoinOptimizer {
+  static constexpr int FRAME = 128;
+  static constexpr int HOP = 32;
+  static constexpr int BANDS = 20;
+  static constexpr int CEPSTRA = 12;
+  // Furthest shift of the next unit when aligning waveforms
+  static constexpr int MAX_LAG = HOP / 2;
+
+  typedef std::array<float, CEPSTRA> Features;
+
+  JoinOptimizer(unsigned sampleRate, bool xcorr = false);
+
+  // Moves the boundary between p and n, keeping their total duration,
+  // returns by how many samples
+  int couple(SpeechWaveData& p, SpeechWaveData& n);
+
+private:
+  typedef std::complex<float> Complex;
+
+  struct Band {
+    int first;
+    std::vector<float> weights;
+  };
+
+  // Features of `count` frames starting at `from`, `HOP` samples apart
+  void analyse(const SpeechWaveData& w, int from, int count, Features* out);
+  // Shift of n's start that best continues p past the cut, in [minLag, maxLag]
+  int align(const SpeechWaveData& p, int cut, const SpeechWaveData& n, int start,
+            int minLag, int maxLag);
+
+  unsigned sampleRate;
+  bool xcorr;
+  ft::RealFFTPlan<float> plan;
+  ft::FFTPlan<float> xcorrPlan;
+  std::array<float, FRAME> window, frame;
+  std::vector<Band> bands;
+  std::array<std::array<float, BANDS>, CEPSTRA> dct;
+  std::vector<Complex> buffer, reference;
+  std::vector<Features> pFeatures, nFeatures;
+};
+
+#endif
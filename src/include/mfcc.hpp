@@ -0,0 +1,88 @@
+#ifndef __MFCC_HPP__
+#define __MFCC_HPP__
+
+#include<cmath>
+#include<map>
+#include<memory>
+#include<tuple>
+#include<vector>
+
+#include"libmfcc.hpp"
+
+// Same coefficients as libmfcc's GetCoefficient, with the filterbank
+// and the DCT computed once. Each filter only keeps the bins it
+// covers, and the log filter energies of a frame are shared by all
+// of its coefficients.
+struct MFCCExtractor {
+  MFCCExtractor(unsigned sampleRate, unsigned binSize, unsigned filters)
+    : sampleRate(sampleRate), binSize(binSize), filters(filters),
+      bands(filters), dct(filters * filters), norms(filters) {
+    for(auto l = 1u; l <= filters; l++) {
+      auto& band = bands[l - 1];
+      for(auto k = 0u; k + 1 < binSize; k++) {
+        auto weight = GetFilterParameter(sampleRate, binSize, k, l);
+        if(weight == 0)
+          continue;
+        band.bins.push_back(k);
+        band.weights.push_back(weight);
+      }
+    }
+
+    for(auto m = 0u; m < filters; m++) {
+      norms[m] = NormalizationFactor(filters, m);
+      for(auto l = 1u; l <= filters; l++)
+        dct[m * filters + l - 1] = std::cos(((m * PI) / filters) * (l - 0.5f));
+    }
+  }
+
+  // Coefficients first .. first + count - 1 of a spectrum of binSize values
+  void compute(const double* spectrum, double* out,
+               unsigned count, unsigned first = 1) const {
+    double energies[filters];
+    for(auto l = 0u; l < filters; l++) {
+      auto& band = bands[l];
+      double sum = 0;
+      for(auto i = 0u; i < band.bins.size(); i++)
+        sum += std::fabs(spectrum[band.bins[i]] * band.weights[i]);
+      // The log of 0 is undefined, so don't use it
+      energies[l] = sum > 0 ? std::log(sum) : sum;
+    }
+
+    for(auto i = 0u; i < count; i++) {
+      unsigned m = first + i;
+      if(m >= filters) {
+        out[i] = 0;
+        continue;
+      }
+      auto row = &dct[m * filters];
+      double sum = 0;
+      for(auto l = 0u; l < filters; l++)
+        sum += energies[l] * row[l];
+      out[i] = norms[m] * sum;
+    }
+  }
+
+  // Extractors are built once per configuration and thread
+  static const MFCCExtractor& get(unsigned sampleRate, unsigned binSize,
+                                  unsigned filters) {
+    typedef std::tuple<unsigned, unsigned, unsigned> Key;
+    static thread_local std::map<Key, std::unique_ptr<MFCCExtractor> > extractors;
+    auto& result = extractors[Key(sampleRate, binSize, filters)];
+    if(!result)
+      result.reset(new MFCCExtractor(sampleRate, binSize, filters));
+    return *result;
+  }
+
+  unsigned sampleRate, binSize, filters;
+
+private:
+  struct Band {
+    std::vector<unsigned> bins;
+    std::vector<double> weights;
+  };
+
+  std::vector<Band> bands;
+  std::vector<double> dct, norms;
+};
+
+#endif
@@ -105,7 +105,7 @@ struct Options {
     return true;
   }
 
-  enum Mode { SYNTH, QUERY, RESYNTH, TRAIN, BASELINE, COUPLE, PSOLA, COMPARE, INVALID };
+  enum Mode { SYNTH, QUERY, RESYNTH, TRAIN, BASELINE, COUPLE, PSOLA, COMPARE, COMPARE_BATCH, INVALID };
 
   Mode get_mode() {
     std::string str = get_string("mode");
@@ -117,9 +117,16 @@ struct Options {
     else if(str == "couple") return Mode::COUPLE;
     else if(str == "psola") return Mode::PSOLA;
     else if(str == "compare") return Mode::COMPARE;
+    else if(str == "compare-batch") return Mode::COMPARE_BATCH;
     return Mode::INVALID;
   }
 
+  // Comparisons only read the WAV files they are given
+  bool needs_databases() {
+    auto mode = get_mode();
+    return mode != Mode::COMPARE && mode != Mode::COMPARE_BATCH;
+  }
+
   static Options parse_options(unsigned argc, const char** argv) {
     Options opts(argc, argv);
 
@@ -142,6 +149,8 @@ struct Options {
   }
 
   static bool has_required(Options& opts) {
+    if(!opts.needs_databases())
+      return true;
     return opts.check_opt("synth-database")
       && opts.check_opt("test-database");
   }
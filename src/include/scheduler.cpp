@@ -0,0 +1,304 @@
+#include<algorithm>
+
+#include"scheduler.hpp"
+#include"util.hpp"
+
+namespace {
+  // Chase-Lev deque of a fixed size, only its worker pushes and pops at
+  // the bottom, the others steal from the top
+  struct WorkDeque {
+    static constexpr long SIZE = 1024;
+
+    WorkDeque(): top(0), bottom(0) {
+      for(auto& slot : slots)
+        slot.store(0, std::memory_order_relaxed);
+    }
+
+    // False if full
+    bool push(Task* task) {
+      auto b = bottom.load(std::memory_order_relaxed);
+      auto t = top.load(std::memory_order_acquire);
+      if(b - t >= SIZE)
+        return false;
+      slots[b & (SIZE - 1)].store(task, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return true;
+    }
+
+    Task* pop() {
+      auto b = bottom.load(std::memory_order_relaxed) - 1;
+      bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto t = top.load(std::memory_order_relaxed);
+      if(t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return 0;
+      }
+      auto result = slots[b & (SIZE - 1)].load(std::memory_order_relaxed);
+      if(t == b) {
+        // The last one, a thief may be taking it as well
+        if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed))
+          result = 0;
+        bottom.store(b + 1, std::memory_order_relaxed);
+      }
+      return result;
+    }
+
+    Task* steal() {
+      auto t = top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto b = bottom.load(std::memory_order_acquire);
+      if(t >= b)
+        return 0;
+      auto result = slots[t & (SIZE - 1)].load(std::memory_order_relaxed);
+      if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+        return 0;
+      return result;
+    }
+
+    std::atomic<long> top, bottom;
+    std::atomic<Task*> slots[SIZE];
+  };
+
+  // Tasks no thread holds, threads take and return them in batches
+  struct TaskPool {
+    ~TaskPool() {
+      while(free) {
+        auto next = free->next;
+        delete free;
+        free = next;
+      }
+    }
+
+    std::mutex mutex;
+    Task* free = 0;
+  };
+
+  TaskPool& pool() {
+    static TaskPool result;
+    return result;
+  }
+
+  // Tasks are mostly released by another thread than the one that
+  // allocated them, the shared pool evens that out
+  struct TaskCache {
+    static constexpr unsigned BATCH = 32;
+
+    ~TaskCache() { give_back(count); }
+
+    Task* take() {
+      if(!free) {
+        auto& p = pool();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        while(p.free && count < BATCH) {
+          auto task = p.free;
+          p.free = task->next;
+          task->next = free;
+          free = task;
+          count++;
+        }
+      }
+      if(!free)
+        return new Task();
+      auto task = free;
+      free = task->next;
+      count--;
+      return task;
+    }
+
+    void give(Task* task) {
+      task->next = free;
+      free = task;
+      if(++count > 2 * BATCH)
+        give_back(BATCH);
+    }
+
+    void give_back(unsigned n) {
+      auto& p = pool();
+      std::lock_guard<std::mutex> lock(p.mutex);
+      for(; n > 0 && free; n--) {
+        auto task = free;
+        free = task->next;
+        task->next = p.free;
+        p.free = task;
+        count--;
+      }
+    }
+
+    Task* free = 0;
+    unsigned count = 0;
+  };
+
+  thread_local TaskCache cache;
+}
+
+struct Scheduler::Worker {
+  Worker(Scheduler* scheduler, unsigned index): scheduler(scheduler), index(index) { }
+
+  Scheduler* scheduler;
+  unsigned index;
+  WorkDeque deque;
+};
+
+thread_local Scheduler::Worker* Scheduler::CURRENT = 0;
+
+Scheduler::Scheduler(unsigned threads)
+  : queued(0), sleeping(0), stopping(false) {
+  threads = std::max(1u, threads);
+  for(auto i = 0u; i < threads; i++)
+    workers.emplace_back(new Worker(this, i));
+  for(auto& w : workers) {
+    auto worker = w.get();
+    this->threads.emplace_back([this, worker] { loop(worker); });
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for(auto& t : threads)
+    t.join();
+}
+
+Task* Scheduler::allocate() {
+  return cache.take();
+}
+
+void Scheduler::release(Task* task) {
+  task->reset();
+  cache.give(task);
+}
+
+Scheduler::Worker* Scheduler::current() const {
+  auto worker = CURRENT;
+  return worker && worker->scheduler == this ? worker : 0;
+}
+
+void Scheduler::push(Task* task) {
+  // Counted before it can be taken, so the count never goes below 0
+  queued++;
+  auto self = current();
+  if(!self || !self->deque.push(task)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    injected.push_back(task);
+  }
+  // Workers count themselves as sleeping before checking for tasks,
+  // so either they see this one or it sees them
+  if(sleeping.load() > 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    wake.notify_one();
+  }
+}
+
+Task* Scheduler::take(Worker* self) {
+  Task* result = 0;
+  if(self)
+    result = self->deque.pop();
+
+  if(!result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!injected.empty()) {
+      result = injected.front();
+      injected.pop_front();
+    }
+  }
+
+  if(!result) {
+    auto start = self ? self->index + 1 : 0;
+    for(auto i = 0u; i < workers.size() && !result; i++) {
+      auto& victim = workers[(start + i) % workers.size()];
+      if(victim.get() != self)
+        result = victim->deque.steal();
+    }
+  }
+
+  if(result)
+    queued--;
+  return result;
+}
+
+void Scheduler::execute(Task* task) {
+  auto group = task->group;
+  std::exception_ptr error;
+  try {
+    task->run();
+  } catch(...) {
+    error = std::current_exception();
+  }
+  // What the task captured goes before its group is done
+  release(task);
+
+  if(group)
+    group->finish(error);
+  else if(error) {
+    try {
+      std::rethrow_exception(error);
+    } catch(std::exception& e) {
+      ERROR("Task failed: " << e.what());
+    } catch(...) {
+      ERROR("Task failed");
+    }
+  }
+}
+
+bool Scheduler::run_one() {
+  auto task = take(current());
+  if(!task)
+    return false;
+  execute(task);
+  return true;
+}
+
+void Scheduler::loop(Worker* self) {
+  CURRENT = self;
+  while(true) {
+    if(auto task = take(self)) {
+      execute(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    sleeping++;
+    wake.wait(lock, [&] { return stopping || queued.load() > 0; });
+    sleeping--;
+    if(stopping && queued.load() == 0)
+      break;
+  }
+  CURRENT = 0;
+}
+
+TaskGroup::~TaskGroup() {
+  wait_all();
+}
+
+void TaskGroup::finish(std::exception_ptr e) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(e && !error)
+    error = e;
+  // Under the lock, the group may be gone as soon as a waiter sees 0
+  if(--pending == 0)
+    done.notify_all();
+}
+
+void TaskGroup::wait_all() {
+  // Queued tasks of the group are run by this thread or taken by
+  // others, once none is left to take the rest is already running
+  while(pending.load() > 0 && scheduler.run_one());
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return pending.load() == 0; });
+}
+
+void TaskGroup::wait() {
+  wait_all();
+  if(error) {
+    auto e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
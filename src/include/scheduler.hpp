@@ -0,0 +1,164 @@
+#ifndef __SCHEDULER_HPP__
+#define __SCHEDULER_HPP__
+
+#include<atomic>
+#include<condition_variable>
+#include<cstddef>
+#include<deque>
+#include<exception>
+#include<future>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<type_traits>
+#include<utility>
+#include<vector>
+
+struct TaskGroup;
+
+// A callable kept inline, no allocation per task. Tasks are meant to
+// capture a few pointers or indexes, larger state belongs to the caller.
+struct Task {
+  static constexpr size_t CAPACITY = 48;
+
+  Task(): call(0), destroy(0), group(0), next(0) { }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() { reset(); }
+
+  template<class F>
+  void set(F&& f, TaskGroup* g) {
+    typedef typename std::decay<F>::type Fn;
+    static_assert(sizeof(Fn) <= CAPACITY, "Task captures too much");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t), "Task is overaligned");
+    reset();
+    new(&storage) Fn(std::forward<F>(f));
+    call = [](void* p) { (*(Fn*) p)(); };
+    destroy = [](void* p) { ((Fn*) p)->~Fn(); };
+    group = g;
+  }
+
+  void run() { call(&storage); }
+
+  void reset() {
+    if(destroy)
+      destroy(&storage);
+    call = 0;
+    destroy = 0;
+    group = 0;
+  }
+
+  typename std::aligned_storage<CAPACITY, alignof(std::max_align_t)>::type storage;
+  void (*call)(void*);
+  void (*destroy)(void*);
+  TaskGroup* group;
+  // Recycled tasks are kept in lists
+  Task* next;
+};
+
+// Work-stealing scheduler. Each worker runs the tasks it spawns itself
+// last in, first out from its own deque, idle workers steal the oldest
+// ones of the others. Tasks spawned by other threads go through a
+// shared queue. Tasks may spawn and wait for more tasks.
+struct Scheduler {
+  explicit Scheduler(unsigned threads);
+  // Runs what is still queued first
+  ~Scheduler();
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // Fire and forget, exceptions are logged
+  template<class F>
+  void spawn(F&& f) {
+    auto task = allocate();
+    task->set(std::forward<F>(f), 0);
+    push(task);
+  }
+
+  // The result or exception of f. Waiting on the future blocks the
+  // thread, inside of tasks a TaskGroup keeps it working instead.
+  template<class F>
+  auto async(F&& f) -> std::future<decltype(f())> {
+    typedef decltype(f()) R;
+    auto task = std::make_shared<std::packaged_task<R()> >(std::forward<F>(f));
+    auto result = task->get_future();
+    spawn([task] { (*task)(); });
+    return result;
+  }
+
+  // Runs one queued task on the calling thread, false if there was none
+  bool run_one();
+
+  unsigned size() const { return workers.size(); }
+  // Whether the calling thread is one of the workers
+  bool is_worker() const { return current() != 0; }
+
+private:
+  friend struct TaskGroup;
+  struct Worker;
+
+  static Task* allocate();
+  static void release(Task* task);
+  void push(Task* task);
+  Task* take(Worker* self);
+  void execute(Task* task);
+  void loop(Worker* self);
+  Worker* current() const;
+
+  // The worker running on this thread, if any
+  static thread_local Worker* CURRENT;
+
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<Task*> injected;
+  // Tasks pushed and not taken yet, and workers waiting for one
+  std::atomic<int> queued, sleeping;
+  bool stopping;
+};
+
+// Tasks waited for together. wait() runs queued tasks while its own
+// aren't done and rethrows the first exception one of them threw.
+struct TaskGroup {
+  explicit TaskGroup(Scheduler& scheduler): scheduler(scheduler), pending(0) { }
+  // Waits, but an exception is dropped
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  template<class F>
+  void run(F&& f) {
+    auto task = Scheduler::allocate();
+    task->set(std::forward<F>(f), this);
+    pending++;
+    scheduler.push(task);
+  }
+
+  void wait();
+
+private:
+  friend struct Scheduler;
+  void finish(std::exception_ptr e);
+  void wait_all();
+
+  Scheduler& scheduler;
+  std::atomic<unsigned> pending;
+  std::mutex mutex;
+  std::condition_variable done;
+  std::exception_ptr error;
+};
+
+// f(i) for every i in [begin, end) on the scheduler
+template<class F>
+void parallel_for(Scheduler& scheduler, unsigned begin, unsigned end, const F& f) {
+  TaskGroup group(scheduler);
+  for(auto i = begin; i < end; i++)
+    group.run([&f, i] { f(i); });
+  group.wait();
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include<cstdlib>
+#include<fstream>
+#include<limits>
+
+#include"score_cache.hpp"
+#include"util.hpp"
+
+uint64_t ScoreCache::hash(const std::vector<int>& path) {
+  // FNV-1a
+  uint64_t result = 14695981039346656037ull;
+  for(auto id : path) {
+    result ^= (uint32_t) id;
+    result *= 1099511628211ull;
+  }
+  return result;
+}
+
+bool ScoreCache::find(unsigned sentence, const std::vector<int>& path,
+                      const std::string& metric, double& score) {
+  Key key = { sentence, hash(path), metric };
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto range = entries.equal_range(key);
+    for(auto it = range.first; it != range.second; it++)
+      if(it->second.path == path) {
+        score = it->second.score;
+        hits++;
+        return true;
+      }
+  }
+  misses++;
+  return false;
+}
+
+void ScoreCache::add(unsigned sentence, const std::vector<int>& path,
+                     const std::string& metric, double score) {
+  Key key = { sentence, hash(path), metric };
+  std::lock_guard<std::mutex> lock(mutex);
+  auto range = entries.equal_range(key);
+  for(auto it = range.first; it != range.second; it++)
+    if(it->second.path == path)
+      return;
+  entries.emplace(key, Entry { path, score });
+}
+
+size_t ScoreCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+// One score per line: sentence metric score length ids...
+bool ScoreCache::load(const std::string& file, const std::string& tag) {
+  std::ifstream s(file);
+  if(!s)
+    return false;
+  std::string fileTag;
+  std::getline(s, fileTag);
+  if(fileTag != tag) {
+    WARN("Score cache " << file << " is for " << fileTag << ", ignoring it");
+    return false;
+  }
+
+  unsigned sentence, length;
+  // Read as text, streams don't parse inf or nan
+  std::string metric, score;
+  std::vector<int> path;
+  while(s >> sentence >> metric >> score >> length) {
+    path.resize(length);
+    for(auto& id : path)
+      s >> id;
+    if(!s)
+      break;
+    add(sentence, path, metric, std::strtod(score.c_str(), 0));
+  }
+  return true;
+}
+
+void ScoreCache::save(const std::string& file, const std::string& tag) const {
+  std::ofstream s(file);
+  s.precision(std::numeric_limits<double>::max_digits10);
+  s << tag << "\n";
+  std::lock_guard<std::mutex> lock(mutex);
+  for(auto& it : entries) {
+    s << it.first.sentence << " " << it.first.metric << " "
+      << it.second.score << " " << it.second.path.size();
+    for(auto id : it.second.path)
+      s << " " << id;
+    s << "\n";
+  }
+}
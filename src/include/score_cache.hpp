@@ -0,0 +1,61 @@
+#ifndef __SCORE_CACHE_HPP__
+#define __SCORE_CACHE_HPP__
+
+#include<atomic>
+#include<cstdint>
+#include<mutex>
+#include<string>
+#include<unordered_map>
+#include<vector>
+
+// Comparison scores of synthesized paths by sentence, path and metric.
+// Outputs only change at a few points along a search direction, so most
+// paths a search evaluates have been scored before. Safe to share
+// between threads.
+struct ScoreCache {
+  ScoreCache(): hits(0), misses(0) { }
+
+  bool find(unsigned sentence, const std::vector<int>& path,
+            const std::string& metric, double& score);
+  void add(unsigned sentence, const std::vector<int>& path,
+           const std::string& metric, double score);
+
+  // Scores only hold for the databases they were computed with,
+  // so a file saved with another tag is ignored
+  bool load(const std::string& file, const std::string& tag);
+  void save(const std::string& file, const std::string& tag) const;
+
+  size_t size() const;
+
+  std::atomic<unsigned> hits, misses;
+
+private:
+  struct Key {
+    unsigned sentence;
+    uint64_t hash;
+    std::string metric;
+
+    bool operator==(const Key& o) const {
+      return sentence == o.sentence && hash == o.hash && metric == o.metric;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return k.hash ^ (k.sentence * 0x9e3779b97f4a7c15ull) ^ std::hash<std::string>()(k.metric);
+    }
+  };
+
+  // Paths are kept to tell hash collisions apart
+  struct Entry {
+    std::vector<int> path;
+    double score;
+  };
+
+  static uint64_t hash(const std::vector<int>& path);
+
+  mutable std::mutex mutex;
+  std::unordered_multimap<Key, Entry, KeyHash> entries;
+};
+
+#endif
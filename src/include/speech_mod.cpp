@@ -6,6 +6,8 @@
 #include"util.hpp"
 #include"fourier.hpp"
 #include"comparisons.hpp"
+#include"join.hpp"
+#include"scheduler.hpp"
 
 using namespace util;
 using std::vector;
@@ -19,21 +21,21 @@ double hann(double i, int size) {
   //return 0.5 * (1 - cos(2 * M_PI * i / size));
 }
 
-void gen_fall(double* data, int size, bool window=true) {
+void gen_fall(signal_t* data, int size, bool window=true) {
   size++;
   //transform(data, size, [&](int, double&) { return 1; });
   size = size * 2;
-  transform(data, size / 2, [=](int i, double) {
+  transform(data, size / 2, [=](int i, signal_t) -> signal_t {
       i += size/2;
       return window ? hann(i, size) : 1;
     });
 }
 
-void gen_rise(double* data, int size, bool window=true) {
+void gen_rise(signal_t* data, int size, bool window=true) {
   size++;
   //transform(data, size, [&](int, double&) { return 1; });
   size = size * 2;
-  transform(data, size / 2, [=](int i, double) {
+  transform(data, size / 2, [=](int i, signal_t) -> signal_t {
       return window ? hann(i, size) : 1;
     });
 }
@@ -53,11 +55,15 @@ void copyVoicelessPart(const SpeechWaveData& source,
                        int sMark,
                        int sourceBound,
                        SpeechWaveData dest);
-int scaleToPitchAndDuration(SpeechWaveData dest,
-                            SpeechWaveData source,
-                            PitchRange pitch,
-                            int lastMark,
-                            int debugIndex);
+PsolaPlan planPitchAndDuration(const SpeechWaveData& dest,
+                               const SpeechWaveData& source,
+                               const PitchRange& pitch,
+                               int lastMark,
+                               int debugIndex,
+                               Arena* arena);
+void applyPsolaPlan(const SpeechWaveData& source,
+                    SpeechWaveData& dest,
+                    const PsolaPlan& plan);
 
 PitchTier initPitchTier(PitchRange* tier, vector<PhonemeInstance> target, const WaveData& dest, const Options& opts) {
   unsigned i = 0;
@@ -89,42 +95,40 @@ PitchTier initPitchTier(PitchRange* tier, vector<PhonemeInstance> target, const
       };
 }
 
-static vector<stime_t> findPitchMarks(const vector<stime_t>& marks,
-                                      stime_t start, stime_t end) {
-  vector<stime_t> result;
-  for(auto mark : marks) {
+static int readSourceUnit(SpeechWaveSynthesis& w, int index, SpeechWaveData& part) {
+  auto& p = w.source[index];
+  const FileData& fileData = w.origin.file_data_of(p);
+  Wave wav(fileData.file);
+
+  // extract wave data
+  part.init(wav, p.start, p.end, w.arena);
+
+  // copy pitch marks, translating to part-local sample
+  part.marks = ArenaVector<int>(ArenaAllocator<int>(w.arena));
+  for(auto mark : fileData.pitch_marks) {
     // Omit boundaries on purpose
-    if(mark > start && mark < end)
-      result.push_back(mark - start);
+    if(mark > p.start && mark < p.end)
+      part.marks.push_back(wav.toSamples(mark - p.start));
   }
-  return result;
+
+  return wav.sampleRate();
 }
 
-static int readSourceData(SpeechWaveSynthesis& w, std::vector<SpeechWaveData>& destParts) {
-  int result = 0, i = 0;
+static int readSourceData(SpeechWaveSynthesis& w, ArenaVector<SpeechWaveData>& destParts) {
+  int result = 0;
   // TODO: possibly avoid reading a file multiple times...
-  for(auto& p : w.source) {
-    FileData fileData = w.origin.file_data_of(p);
-    Wave wav(fileData.file);
-
-    result = wav.sampleRate();
-    PsolaConstants limits(wav.sampleRate());
-
-    SpeechWaveData part;
-    // extract wave data
-    part.init(wav, p.start, p.end);
-
-    // copy pitch marks, translating to part-local sample
-    auto marks = findPitchMarks(fileData.pitch_marks, p.start, p.end);
-    for(auto mark : marks)
-      part.marks.push_back(wav.toSamples(mark));
-
-    destParts[i] = part;
-    i++;
-  }
+  for(auto i = 0u; i < w.source.size(); i++)
+    result = readSourceUnit(w, i, destParts[i]);
   return result;
 }
 
+static unsigned readSampleRate(SpeechWaveSynthesis& w) {
+  std::ifstream str(w.origin.file_data_of(w.source[0]).file);
+  WaveHeader h;
+  str.read((char*) &h, sizeof(h));
+  return h.sampleRate;
+}
+
 Wave SpeechWaveSynthesis::get_resynthesis_td() {
   Options opts;
   opts.log = false;
@@ -134,8 +138,9 @@ Wave SpeechWaveSynthesis::get_resynthesis_td() {
 }
 
 Wave SpeechWaveSynthesis::get_concatenation() {
+  ArenaScope scope(*arena);
   // First off, collect the WAV data for each source unit
-  vector<SpeechWaveData> waveData(source.size());
+  ArenaVector<SpeechWaveData> waveData(source.size(), SpeechWaveData(), arena);
   auto sampleRate = readSourceData(*this, waveData);
 
   // First off, prepare for output, build some default header...
@@ -143,18 +148,21 @@ Wave SpeechWaveSynthesis::get_concatenation() {
   h.sampleRate = sampleRate;
   h.byteRate = sampleRate * 2;
 
-  WaveBuilder wb(h);
-  for(auto wd : waveData)
-    wb.append(wd);
+  unsigned totalBytes = 0;
+  for(auto& wd : waveData)
+    totalBytes += wd.length * sizeof(short);
 
-  std::for_each(waveData.begin(), waveData.end(), WaveData::deallocate);
+  WaveBuilder wb(h, totalBytes);
+  for(auto& wd : waveData)
+    wb.append(wd);
 
   return wb.build();
 }
 
 Wave SpeechWaveSynthesis::get_resynthesis(const Options& opts) {
+  ArenaScope scope(*arena);
   // First off, collect the WAV data for each source unit
-  vector<SpeechWaveData> waveData(source.size());
+  ArenaVector<SpeechWaveData> waveData(source.size(), SpeechWaveData(), arena);
   auto sampleRate = readSourceData(*this, waveData);
 
   // First off, prepare for output, build some default header...
@@ -168,118 +176,50 @@ Wave SpeechWaveSynthesis::get_resynthesis(const Options& opts) {
     double completeDuration = 0;
     each(target, [&](const PhonemeInstance& p) { completeDuration += p.duration; });
     // preallocate the complete wave result,
-    // but only temporarily
-    WaveDataTemp result(WaveData::allocate(completeDuration, sampleRate));
+    // the builder takes it over as it is
+    WaveData result(WaveData::allocate(completeDuration, sampleRate));
     do_resynthesis(result, waveData, opts);
-    wb.append(result);
+    wb.adopt(result);
   }
 
-  std::for_each(waveData.begin(), waveData.end(), WaveData::deallocate);
-
   return wb.build();
 }
 
-template<class Frame>
-void extractFrame(Frame& f, WaveData& src, int from) {
-  for(auto i = 0u; i < f.size(); i++)
-    f[i] = src[from + i];
-}
-
-template<class Frame>
-double diffFrames(const Frame& f1, const Frame& f2, int sampleRate) {
-  std::array<double, 5> mfcc1, mfcc2;
-  computeMFCC(f1, mfcc1, sampleRate);
-  computeMFCC(f2, mfcc2, sampleRate);
-  double result = 0;
-  for(auto i = 0u; i < mfcc1.size(); i++)
-    result += std::abs(mfcc1[i] - mfcc2[i]);
-  //INFO("diff " << result);
-  return result;
-}
-
-template<class Frame>
-double diffFramesAtOffset(SpeechWaveData& p, SpeechWaveData& n, int offset,
-                          Frame& pFrame, Frame& nFrame) {
-  // Assume bound-checked
-  extractFrame(pFrame, p, p.length + offset);
-  extractFrame(nFrame, n, - offset);
-  return diffFrames(pFrame, nFrame, p.sampleRate);
-}
-
-int couplePieces(SpeechWaveData& p, SpeechWaveData& n) {
-  constexpr auto FRAME = 128;
-  constexpr auto STEP = 32;
-
-  std::valarray<cdouble> pFrame(FRAME), nFrame(FRAME);
-
-  auto minDiff = diffFramesAtOffset(p, n, 0, pFrame, nFrame);
-  auto minOffset = 0;
-
-  auto maxBoundaryOffset = std::min(p.extra.length - p.length,
-                                    n.length / 2);
-  auto minBoundaryOffset = std::max(-p.length / 2,
-                                    n.extra.offset - n.offset);
-
-  INFO("Trying to adjust between " << minBoundaryOffset << ", " << maxBoundaryOffset);
-  for(auto currentBoundaryOffset = minBoundaryOffset;
-      currentBoundaryOffset + STEP < maxBoundaryOffset;
-      currentBoundaryOffset += STEP) {
-    auto diffAtCurrent = diffFramesAtOffset(p, n, currentBoundaryOffset,
-                                            pFrame, nFrame);
-    if(diffAtCurrent < minDiff)
-      minOffset = currentBoundaryOffset;
-  }
-
-  auto preDuration = p.duration() + n.duration();
-
-  p.length += minOffset;
-  n.offset += minOffset;
-  n.length -= minOffset;
-
-  auto postDuration = p.duration() + n.duration();
-
-  assert(p.length > 0);
-  assert(p.offset >= 0);
-  assert(n.length > 0);
-  assert(n.offset >= 0);
-  // Due to double-rounding errors, it's possible that
-  // they differ as time points, but not as samples...
-  assert(p.toSamples(preDuration - postDuration) == 0);
-
-  return minOffset;
-}
-
-void do_coupling(vector<SpeechWaveData>& pieces) {
-  auto i = 1u;
-  while(i < pieces.size()) {
-    auto adjustment = couplePieces(pieces[i - 1], pieces[i]);
+template<class Pieces>
+void do_coupling(Pieces& pieces, bool xcorr) {
+  JoinOptimizer joins(pieces[0].sampleRate, xcorr);
+  for(auto i = 1u; i < pieces.size(); i++) {
+    auto adjustment = joins.couple(pieces[i - 1], pieces[i]);
     INFO("Adjust " << i << " by " << adjustment);
-    i++;
   }
 }
 
-Wave SpeechWaveSynthesis::get_coupling(const Options&) {
+Wave SpeechWaveSynthesis::get_coupling(const Options& opts) {
   const auto N = source.size();
   assert(N > 1);
-  vector<SpeechWaveData> waveData(N);
+  ArenaScope scope(*arena);
+  ArenaVector<SpeechWaveData> waveData(N, SpeechWaveData(), arena);
   auto sampleRate = readSourceData(*this, waveData);
 
-  do_coupling(waveData);
+  do_coupling(waveData, opts.has_opt("join-xcorr"));
 
   // Now simply transfer and cleanup...
   WaveHeader h = WaveHeader::default_header();
   h.sampleRate = sampleRate;
   h.byteRate = sampleRate * 2;
 
-  WaveBuilder wb(h);
+  unsigned totalBytes = 0;
+  for(auto& p : waveData)
+    totalBytes += p.length * sizeof(short);
+
+  WaveBuilder wb(h, totalBytes);
   for(auto& p : waveData)
     wb.append(p);
-  std::for_each(waveData.begin(), waveData.end(), WaveData::deallocate);
   return wb.build();
 }
 
 template<bool flip=false>
-int overlapAddAroundMark(SpeechWaveData& src,
+int overlapAddAroundMark(const SpeechWaveData& src,
                          int sMark,
                          SpeechWaveData& dst,
                          int dMark,
@@ -295,7 +235,7 @@ int overlapAddAroundMark(SpeechWaveData& src,
   DEBUG(LOG("Mark " << dMark));
 
   // Will reuse window space...
-  double window[std::max(samplesLeft, samplesRight) + 1];
+  signal_t window[std::max(samplesLeft, samplesRight) + 1];
 
   // It's what they call...
   int destBot, destTop, sourceBot, sourceTop;
@@ -311,7 +251,7 @@ int overlapAddAroundMark(SpeechWaveData& src,
   for(auto di = destBot, si = sourceBot, wi = 0;
       di < destTop && si < sourceTop;
       di++, si++, wi++)
-    dest.plus<double>(flip ? destTop - di : di, source[si] * window[wi]);
+    dest.plus<signal_t>(flip ? destTop - di : di, source[si] * window[wi]);
 
   // And Fall
   destBot = std::max(0, dMark);
@@ -325,13 +265,15 @@ int overlapAddAroundMark(SpeechWaveData& src,
   for(auto di = destBot, si = sourceBot, wi = 0;
       di < destTop && si < sourceTop;
       di++, si++, wi++)
-    dest.plus<double>(flip ? destTop - di : di, source[si] * window[wi]);
+    dest.plus<signal_t>(flip ? destTop - di : di, source[si] * window[wi]);
 
   return std::min(destTop - destBot, sourceTop - sourceBot);
 }
 
-void coupleScaledPieces(vector<SpeechWaveData>& scaledPieces,
-                        const vector<SpeechWaveData>& originalPieces) {
+void coupleScaledPieces(ArenaVector<SpeechWaveData>& scaledPieces,
+                        const ArenaVector<SpeechWaveData>& originalPieces,
+                        bool xcorr,
+                        Arena* arena) {
   for(auto i = 0u; i < scaledPieces.size(); i++) {
     auto& scaled = scaledPieces[i];
     auto& original = originalPieces[i];
@@ -339,7 +281,7 @@ void coupleScaledPieces(vector<SpeechWaveData>& scaledPieces,
     SpeechWaveData newScaled;
     newScaled = WaveData::allocate(scaled.duration() +
                                    (original.extra.duration() - original.duration()),
-                                   scaled.sampleRate);
+                                   scaled.sampleRate, arena);
     newScaled.extra = newScaled;
 
     auto extraFrontBegin = original.extra.data + original.extra.offset;
@@ -363,48 +305,136 @@ void coupleScaledPieces(vector<SpeechWaveData>& scaledPieces,
               extraBackEnd,
               newScaled.data + newScaled.offset + newScaled.length);
 
-    WaveData::deallocate(scaled);
     scaled = newScaled;
   }
 
-  do_coupling(scaledPieces);
+  do_coupling(scaledPieces, xcorr);
 }
 
-void smooth(WaveData dest, int destOffset, PitchRange pitch) {
+template<class Dest>
+void smooth(Dest& dest, int destOffset, PitchRange pitch) {
   auto pv = pitch.at(destOffset);
   auto samples = dest.toSamples(1 / pv);
   if(destOffset < samples || pv < 50)
     return;
 
+  // By value, taking a sample of a stream window may move the others
   for(auto i = 0; i < samples; i++) {
-    auto& a = dest[destOffset - samples + i];
-    auto& b = dest[destOffset + i];
+    auto a = dest[destOffset - samples + i];
+    auto b = dest[destOffset + i];
     auto t = 0.5;
-    auto c = a*t + b*(1-2);
+    short c = a*t + b*(1-2);
+
+    dest[destOffset - samples + i] = c;
+    dest[destOffset + i] = c;
+  }
+}
+
+// Adds a scaled unit and its extra edges to the output,
+// destOffset is moved to the end of the unit
+template<class Dest>
+void transferScaledPiece(Dest& dest, int& destOffset,
+                         const SpeechWaveData& p, const PitchRange& pitch) {
+  auto extraOffset = p.offset - p.extra.offset;
+  if(destOffset >= extraOffset) {
+    destOffset -= extraOffset;
+    for(auto i = 0; i < extraOffset; i++, destOffset++)
+      dest.template plus<double>(destOffset, p.extra[i]);
+  }
+
+  auto leftEdge = destOffset;
+  for(auto i = 0; i < p.length && destOffset < dest.length; i++, destOffset++)
+    dest.template plus<double>(destOffset, p[i]);
+
+  auto extraLength = (p.extra.length - p.length) / 2;
+  for(auto i = 0; i < extraLength && destOffset + i < dest.length; i++)
+    dest.template plus<double>(destOffset + i, p.extra[p.extra.length - extraLength + i]);
+
+  if(SMOOTH)
+    smooth(dest, leftEdge, pitch);
+}
+
+// Sliding window over the output of a streamed resynthesis,
+// indexed by absolute sample positions
+struct StreamWindow {
+  StreamWindow(int length, unsigned sampleRate)
+    : base(0), length(length), sampleRate(sampleRate) { }
+
+  std::vector<short> buffer;
+  int base, length;
+  unsigned sampleRate;
+
+  short& operator[](int i) {
+    assert(i >= base); // Sample already flushed
+    reserve(i + 1);
+    return buffer[i - base];
+  }
+
+  template<class T>
+  void plus(int i, T val) {
+    auto& sample = (*this)[i];
+    sample = WaveData::addSaturated(sample, val);
+  }
+
+  int toSamples(double duration) const {
+    return WaveData::toSamples(duration, sampleRate);
+  }
 
-    a = b = c;
+  void reserve(int end) {
+    if(end - base > (int) buffer.size())
+      buffer.resize(end - base, 0);
+  }
+
+  // Hands all samples before end to the sink and drops them
+  void flush(WaveSink& sink, int end) {
+    end = std::min(end, length);
+    if(end <= base)
+      return;
+    reserve(end);
+    sink.write(buffer.data(), end - base);
+    buffer.erase(buffer.begin(), buffer.begin() + (end - base));
+    base = end;
+  }
+};
+
+void SpeechWaveSynthesis::synthesize_units(ArenaVector<SpeechWaveData>& scaledPieces,
+                                           const ArenaVector<SpeechWaveData>& pieces,
+                                           const ArenaVector<PsolaPlan>& plans) {
+  // Every unit is overlap-added into its own buffer, so the units
+  // can be processed in any order without changing the result
+  auto unit = [&](unsigned i) { applyPsolaPlan(pieces[i], scaledPieces[i], plans[i]); };
+
+  if(!scheduler || scaledPieces.size() <= 1) {
+    for(auto i = 0u; i < scaledPieces.size(); i++)
+      unit(i);
+    return;
   }
+  parallel_for(*scheduler, 0, scaledPieces.size(), unit);
 }
 
 void SpeechWaveSynthesis::do_resynthesis(WaveData dest,
-                                         const vector<SpeechWaveData>& pieces,
+                                         const ArenaVector<SpeechWaveData>& pieces,
                                          const Options& opts) {
   PitchRange pitchTier[target.size()];
 
   PitchTier pt = initPitchTier(pitchTier, target, dest, opts);
 
   Progress prog(target.size(), "PSOLA: ");
-  vector<SpeechWaveData> scaledPieces(target.size());
+  ArenaVector<SpeechWaveData> scaledPieces(target.size(), SpeechWaveData(), arena);
+  ArenaVector<PsolaPlan> plans(target.size(), PsolaPlan(), arena);
 
+  // Marks of a unit depend on the last mark of the previous one,
+  // so they are planned in order, the grains themselves are not
   auto lastMark = 0;
   for(auto i = 0u; i < target.size(); i++) {
     auto& p = pieces[i];
     auto& pitch = pt.ranges[i];
 
-    scaledPieces[i] = SpeechWaveData::allocate(target[i].duration, dest.sampleRate);
+    scaledPieces[i] = SpeechWaveData::allocate(target[i].duration, dest.sampleRate, arena);
     PRINT_SCALE(i << ": duration = " << p.duration() / scaledPieces[i].duration());
 
-    lastMark = scaleToPitchAndDuration(scaledPieces[i], p, pitch, lastMark, i);
+    plans[i] = planPitchAndDuration(scaledPieces[i], p, pitch, lastMark, i, arena);
+    lastMark = plans[i].lastMark;
 
     //INFO("last mark: " << scaledPieces[i].toDuration(lastMark));
     lastMark -= scaledPieces[i].length;
@@ -414,38 +444,179 @@ void SpeechWaveSynthesis::do_resynthesis(WaveData dest,
   }
   prog.finish();
 
-  //coupleScaledPieces(scaledPieces, pieces);
+  synthesize_units(scaledPieces, pieces, plans);
+
+  if(opts.has_opt("couple"))
+    coupleScaledPieces(scaledPieces, pieces, opts.has_opt("join-xcorr"), arena);
 
   // Now simply transfer and cleanup...
   auto destOffset = 0;
-  int j = 0;
-  for(const auto& p : scaledPieces) {
+  for(auto i = 0u; i < scaledPieces.size(); i++)
+    transferScaledPiece(dest, destOffset, scaledPieces[i], pt.ranges[i]);
+}
+
+void SpeechWaveSynthesis::stream_resynthesis(const Options& opts, WaveSink& sink) {
+  assert(source.size() == target.size() && target.size() > 0);
+  ArenaScope scope(*arena);
+  auto sampleRate = readSampleRate(*this);
+
+  double completeDuration = 0;
+  each(target, [&](const PhonemeInstance& p) { completeDuration += p.duration; });
+  // Same length as the preallocated output of get_resynthesis
+  WaveData bounds(0, 0, completeDuration * sampleRate, sampleRate);
+
+  PitchRange pitchTier[target.size()];
+  PitchTier pt = initPitchTier(pitchTier, target, bounds, opts);
+
+  WaveHeader h = WaveHeader::default_header();
+  h.sampleRate = sampleRate;
+  h.byteRate = sampleRate * 2;
+  h.setSampleBytes(bounds.length * sizeof(short));
+  sink.begin(h);
+
+  // Samples further than this behind the end of the last unit
+  // are no longer touched by the extra edge of the next one or by smoothing
+  auto margin = bounds.toSamples(SpeechWaveData::EXTRA_TIME);
+  StreamWindow window(bounds.length, sampleRate);
+
+  auto lastMark = 0, destOffset = 0;
+  for(auto i = 0u; i < target.size(); i++) {
+    ArenaScope unitScope(*arena);
+    SpeechWaveData piece;
+    readSourceUnit(*this, i, piece);
+
+    auto scaled = SpeechWaveData::allocate(target[i].duration, sampleRate, arena);
+    auto plan = planPitchAndDuration(scaled, piece, pt.ranges[i], lastMark, i, arena);
+    lastMark = plan.lastMark - scaled.length;
+    assert(lastMark >= 0);
+
+    applyPsolaPlan(piece, scaled, plan);
+    transferScaledPiece(window, destOffset, scaled, pt.ranges[i]);
+
+    window.flush(sink, destOffset - margin);
+  }
+  window.flush(sink, bounds.length);
+  sink.finish();
+}
+
+// Output of a transfer restricted to [from, to), samples outside of it
+// are left as they are
+struct ClippedDest {
+  ClippedDest(WaveData& dest, int from, int to)
+    : dest(dest), from(from), to(to), length(dest.length) { }
+
+  WaveData& dest;
+  int from, to, length;
+
+  short& operator[](int i) const { return dest[i]; }
+
+  template<class T>
+  void plus(int i, T val) {
+    if(i >= from && i < to)
+      dest.plus(i, val);
+  }
+
+  int toSamples(double duration) const { return dest.toSamples(duration); }
+};
+
+void SpeechWaveSynthesis::update_resynthesis_td(IncrementalResynthesis& state) {
+  assert(source.size() == target.size() && target.size() > 0);
+  ArenaScope scope(*arena);
+  const auto N = target.size();
+
+  if(state.ids.size() != N) {
+    for(auto& s : state.scaled)
+      WaveData::deallocate(s.extra);
+
+    state.sampleRate = readSampleRate(*this);
+    double completeDuration = 0;
+    each(target, [&](const PhonemeInstance& p) { completeDuration += p.duration; });
+    // Same length as the preallocated output of get_resynthesis
+    state.samples.assign((int) (completeDuration * state.sampleRate), 0);
+
+    Options opts;
+    opts.log = false;
+    state.pitch.resize(N);
+    initPitchTier(state.pitch.data(), target, state.wave(), opts);
+
+    state.ids.assign(N, -1);
+    state.marks.assign(N, -1);
+    state.lastMarks.assign(N, -1);
+    state.starts.resize(N);
+    state.scaled.resize(N);
+    int length = state.samples.size(), start = 0;
+    for(auto i = 0u; i < N; i++) {
+      state.scaled[i] = SpeechWaveData::allocate(target[i].duration, state.sampleRate);
+      // Where transferScaledPiece leaves the body of the unit
+      state.starts[i] = start;
+      start += std::min(state.scaled[i].length, std::max(0, length - start));
+    }
+  }
+
+  auto dest = state.wave();
+  // Samples a unit adds to, with its extra edges
+  auto extent = [&](unsigned i) {
+    auto& p = state.scaled[i];
+    auto start = state.starts[i];
     auto extraOffset = p.offset - p.extra.offset;
-    if(destOffset >= extraOffset) {
-      destOffset -= extraOffset;
-      for(auto i = 0; i < extraOffset; i++, destOffset++)
-        dest.plus<double>(destOffset, p.extra[i]);
+    auto extraLength = (p.extra.length - p.length) / 2;
+    auto end = start + std::min(p.length, std::max(0, dest.length - start));
+    return std::make_pair(start >= extraOffset ? start - extraOffset : start,
+                          std::min(dest.length, end + extraLength));
+  };
+
+  state.changed.clear();
+  auto lastMark = 0;
+  for(auto i = 0u; i < N; i++) {
+    if((int) source[i].id == state.ids[i] && lastMark == state.marks[i]) {
+      lastMark = state.lastMarks[i];
+      continue;
     }
 
-    auto leftEdge = destOffset;
-    for(auto i = 0; i < p.length && destOffset < dest.length; i++, destOffset++)
-      dest.plus<double>(destOffset, p[i]);
+    ArenaScope unitScope(*arena);
+    SpeechWaveData piece;
+    readSourceUnit(*this, i, piece);
 
-    auto extraLength = (p.extra.length - p.length) / 2;
-    for(auto i = 0; i < extraLength && destOffset + i < dest.length; i++)
-      dest.plus<double>(destOffset + i, p.extra[p.extra.length - extraLength + i]);
+    auto& scaled = state.scaled[i];
+    std::fill(scaled.extra.data, scaled.extra.data + scaled.extra.length, 0);
+    auto plan = planPitchAndDuration(scaled, piece, state.pitch[i], lastMark, i, arena);
+    applyPsolaPlan(piece, scaled, plan);
 
-    auto pitch = pt.ranges[j];
-    if(SMOOTH)
-      smooth(dest, leftEdge, pitch);
-    j++;
+    state.ids[i] = source[i].id;
+    state.marks[i] = lastMark;
+    lastMark = state.lastMarks[i] = plan.lastMark - scaled.length;
+    assert(lastMark >= 0);
+
+    auto range = extent(i);
+    if(state.changed.size() && range.first <= state.changed.back().second)
+      state.changed.back().second = std::max(state.changed.back().second, range.second);
+    else
+      state.changed.push_back(range);
+  }
+
+  // Smoothing reaches before the units
+  if(SMOOTH && state.changed.size())
+    state.changed.assign(1, std::make_pair(0, dest.length));
+
+  // Samples are saturated as units are added, so a range is rendered again
+  // from zero, adding the units over it in the same order as a full resynthesis
+  for(auto& range : state.changed) {
+    std::fill(dest.data + range.first, dest.data + range.second, 0);
+    ClippedDest clipped(dest, range.first, range.second);
+    for(auto i = 0u; i < N; i++) {
+      auto unit = extent(i);
+      if(unit.second <= range.first || unit.first >= range.second)
+        continue;
+      auto destOffset = state.starts[i];
+      transferScaledPiece(clipped, destOffset, state.scaled[i], state.pitch[i]);
+    }
   }
-  std::for_each(scaledPieces.begin(), scaledPieces.end(), WaveData::deallocate);
 }
 
-vector<bool> fillMissingMarks(vector<int>& marks, PsolaConstants limits) {
-  vector<int> filled;
-  vector<bool> isVoicelessFlags;
+ArenaVector<bool> fillMissingMarks(ArenaVector<int>& marks, PsolaConstants limits,
+                                   Arena* arena) {
+  ArenaVector<int> filled(arena);
+  ArenaVector<bool> isVoicelessFlags(arena);
   auto lastMark = 0;
   for(auto mark : marks) {
     if(mark - lastMark > limits.maxVoicelessSamples) {
@@ -460,11 +631,11 @@ vector<bool> fillMissingMarks(vector<int>& marks, PsolaConstants limits) {
     filled.push_back(lastMark = mark);
     isVoicelessFlags.push_back(false);
   }
-  marks = filled;
+  marks.swap(filled);
   return isVoicelessFlags;
 }
 
-static int getPeriodOfMark(int markIndex, vector<int>& sourceMarks) {
+static int getPeriodOfMark(int markIndex, const ArenaVector<int>& sourceMarks) {
   auto mark = sourceMarks[markIndex];
   if(mark == 0)
     return sourceMarks[markIndex + 1];
@@ -473,20 +644,25 @@ static int getPeriodOfMark(int markIndex, vector<int>& sourceMarks) {
   return std::min(mark - sourceMarks[markIndex - 1], sourceMarks[markIndex + 1] - mark);
 }
 
-int scaleToPitchAndDuration(SpeechWaveData dest,
-                            SpeechWaveData source,
-                            PitchRange pitch,
-                            int firstMark,
-                            int debugIndex) {
+PsolaPlan planPitchAndDuration(const SpeechWaveData& dest,
+                               const SpeechWaveData& source,
+                               const PitchRange& pitch,
+                               int firstMark,
+                               int debugIndex,
+                               Arena* arena) {
   PsolaConstants limits(dest.sampleRate);
+  PsolaPlan plan;
+  plan.grains = ArenaVector<PsolaGrain>(arena);
 
   // Time scale
   double scale = dest.duration() / source.duration();
 
-  vector<int> sourceMarks(source.marks);
-  sourceMarks.insert(sourceMarks.begin(), 0);
+  ArenaVector<int> sourceMarks(arena);
+  sourceMarks.reserve(source.marks.size() + 2);
+  sourceMarks.push_back(0);
+  sourceMarks.insert(sourceMarks.end(), source.marks.begin(), source.marks.end());
   sourceMarks.push_back(source.length);
-  auto isVoicelessFlags = fillMissingMarks(sourceMarks, limits);
+  auto isVoicelessFlags = fillMissingMarks(sourceMarks, limits, arena);
 
   auto sMarkIndex = 0u;
   auto dMark = firstMark;
@@ -500,7 +676,6 @@ int scaleToPitchAndDuration(SpeechWaveData dest,
     return dest.toSamples(1 / p);
   };
 
-  //static int X = 0;
   while (sMarkIndex < sourceMarks.size() - 1) {
     auto sMark = sourceMarks[sMarkIndex];
     auto scaledSMark = sourceMarks[sMarkIndex + 1] * scale;
@@ -516,11 +691,9 @@ int scaleToPitchAndDuration(SpeechWaveData dest,
         ? limits.voicelessSamplesCopy
         : getPitchPeriod(pitch, dMark, sourcePeriod);
 
-      overlapAddAroundMark(source, sMark, dest, dMark,
-                           sourcePeriod, sourcePeriod);
+      plan.grains.push_back({ sMark, dMark, sourcePeriod });
       PRINT_SCALE(debugIndex << ": " << (double) sourcePeriod / destPeriod);
-      /*SpeechWaveData::toFile(dest, "/tmp/dest-mark-" + std::to_string(X++) + ".wav");
-      INFO(source.toDuration(sMark) << " -> " << dest.toDuration(dMark) << " " << voiceless);
+      /*INFO(source.toDuration(sMark) << " -> " << dest.toDuration(dMark) << " " << voiceless);
       INFO(source.toDuration(sourcePeriod) << " " << dest.toDuration(destPeriod));*/
 
       dMark += destPeriod;
@@ -529,5 +702,14 @@ int scaleToPitchAndDuration(SpeechWaveData dest,
     sMarkIndex++;
   }
   //INFO(debugIndex << ": last mark " << dest.toDuration(dMark - dest.length) << " period: " << dest.toDuration(destPeriod));
-  return dMark;
+  plan.lastMark = dMark;
+  return plan;
+}
+
+void applyPsolaPlan(const SpeechWaveData& source,
+                    SpeechWaveData& dest,
+                    const PsolaPlan& plan) {
+  for(auto& g : plan.grains)
+    overlapAddAroundMark(source, g.sMark, dest, g.dMark,
+                         g.period, g.period);
 }
@@ -2,11 +2,14 @@
 #define __SPEECH_MOD_HPP__
 
 #include<cassert>
+#include<memory>
+#include<utility>
 #include<vector>
 
 #include"speech_synthesis.hpp"
 #include"wav.hpp"
 #include"options.hpp"
+#include"arena.hpp"
 
 using namespace tool;
 
@@ -14,24 +17,66 @@ extern bool SMOOTH;
 extern bool SCALE_ENERGY;
 extern int EXTRA_TIME;
 
+// Hann window of size points at point i
+double hann(double i, int size);
+
+// A single overlap-add step: the grain around sMark in the source
+// is windowed with period samples on each side and added at dMark
+struct PsolaGrain {
+  int sMark;
+  int dMark;
+  int period;
+};
+
+// All grains of a unit, computed before any samples are touched
+struct PsolaPlan {
+  ArenaVector<PsolaGrain> grains;
+  // First destination mark past the end of the unit
+  int lastMark;
+};
+
+struct IncrementalResynthesis;
+struct Scheduler;
+
 struct SpeechWaveSynthesis {
+  // Temporaries of every call come from the arena and are released
+  // when it returns, without an arena there's a private one. Units
+  // are overlap-added on the scheduler of the caller if it gives one.
   SpeechWaveSynthesis(const std::vector<PhonemeInstance>& source,
                       const std::vector<PhonemeInstance>& target,
-                      PhonemeAlphabet& origin)
-    : source(source), target(target), origin(origin)
+                      const PhonemeAlphabet& origin,
+                      Arena* arena = 0,
+                      Scheduler* scheduler = 0)
+    : source(source), target(target), origin(origin),
+      ownArena(arena ? 0 : new Arena()),
+      arena(arena ? arena : ownArena.get()),
+      scheduler(scheduler)
   { };
 
   const std::vector<PhonemeInstance>& source;
   const std::vector<PhonemeInstance>& target;
-  PhonemeAlphabet& origin;
+  const PhonemeAlphabet& origin;
+  std::unique_ptr<Arena> ownArena;
+  Arena* arena;
+  Scheduler* scheduler;
 
   Wave get_resynthesis(const Options&);
   Wave get_concatenation();
   Wave get_resynthesis_td();
 
   Wave get_coupling(const Options&);
+
+  // Resynthesis unit by unit, handing finished samples to the sink
+  void stream_resynthesis(const Options&, WaveSink&);
+
+  // Same samples as get_resynthesis_td, only the units that changed
+  // since the last update of the state are synthesized again
+  void update_resynthesis_td(IncrementalResynthesis&);
 private:
-  void do_resynthesis(WaveData, const std::vector<SpeechWaveData>&, const Options&);
+  void do_resynthesis(WaveData, const ArenaVector<SpeechWaveData>&, const Options&);
+  void synthesize_units(ArenaVector<SpeechWaveData>&,
+                        const ArenaVector<SpeechWaveData>&,
+                        const ArenaVector<PsolaPlan>&);
 };
 
 struct PsolaConstants {
@@ -99,4 +144,31 @@ struct PitchTier {
   }
 };
 
+// A resynthesis of one target kept between calls with different source
+// units. A unit with the same source and the same first mark as before
+// keeps its samples, the output is only rendered again around the rest.
+struct IncrementalResynthesis {
+  IncrementalResynthesis(): sampleRate(0) { }
+  IncrementalResynthesis(const IncrementalResynthesis&) = delete;
+  ~IncrementalResynthesis() {
+    for(auto& s : scaled)
+      WaveData::deallocate(s.extra);
+  }
+
+  WaveData wave() {
+    return WaveData(samples.data(), 0, samples.size(), sampleRate);
+  }
+
+  // Sample ranges [first, second) changed by the last update
+  std::vector<std::pair<int, int> > changed;
+
+  std::vector<short> samples;
+  unsigned sampleRate;
+
+  // Per unit: source id, marks before and after it, start in the output
+  std::vector<int> ids, marks, lastMarks, starts;
+  std::vector<SpeechWaveData> scaled;
+  std::vector<PitchRange> pitch;
+};
+
 #endif
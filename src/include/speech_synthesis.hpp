@@ -37,6 +37,17 @@ namespace tool {
       }
     }
 
+    // Same labels, filtered ones go to scratch instead of a new class
+    const LabelAlphabet<PhonemeInstance>::LabelClass&
+    get_class(const PhonemeInstance& phon,
+              LabelAlphabet<PhonemeInstance>::LabelClass& scratch) const {
+      if(!FORCE_SCALE)
+        return classes[phon.label];
+      scratch.clear();
+      filter(classes[phon.label], scratch, phon);
+      return scratch;
+    }
+
     bool between(double v, double min, double max) const {
       return v >= min && v <= max;
     }
@@ -57,11 +68,11 @@ namespace tool {
       }
     }
 
-    FileData file_data_of(const PhonemeInstance& phon) const {
+    const FileData& file_data_of(const PhonemeInstance& phon) const {
       return files[ file_indices[ phon.id ] ];
     }
 
-    std::vector<PhonemeInstance> to_phonemes(const std::vector<int>& ids) {
+    std::vector<PhonemeInstance> to_phonemes(const std::vector<int>& ids) const {
       std::vector<PhonemeInstance> result;
       for(auto it = ids.begin(); it != ids.end(); it++)
         result.push_back(fromInt(*it));
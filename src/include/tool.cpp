@@ -59,6 +59,8 @@ namespace tool {
     REPORT_PROGRESS = opts->has_opt("progress");
 
     VLOG = std::ofstream(opts->get_opt<std::string>("vlog", "vlog.log"));
+    if(!opts->needs_databases())
+      return true;
 
     crf.label_alphabet = &alphabet_synth;
     baseline_crf.label_alphabet = &alphabet_synth;
@@ -20,6 +20,14 @@ typedef unsigned id_t;
 
 typedef std::complex<cost> cdouble;
 
+// Spectral analysis and overlap-add, single precision when
+// built with -DFLOAT_ANALYSIS
+#ifdef FLOAT_ANALYSIS
+typedef float signal_t;
+#else
+typedef double signal_t;
+#endif
+
 typedef int PhoneticLabel;
 const PhoneticLabel INVALID_LABEL = -1;
 
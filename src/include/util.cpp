@@ -1,11 +1,40 @@
 #include<sstream>
 
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
 #include"util.hpp"
 
 bool COLOR_ENABLED = true;
 bool PRINT_SCALE = false;
 bool REPORT_PROGRESS = false;
 
+MappedFile::MappedFile(const std::string& file): data(0), size(0) {
+  auto fd = open(file.c_str(), O_RDONLY);
+  if(fd < 0) {
+    ERROR("Can't open " << file);
+    return;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size > 0) {
+    auto mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapped != MAP_FAILED) {
+      data = (const char*) mapped;
+      size = st.st_size;
+    } else {
+      ERROR("Can't map " << file);
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if(data)
+    munmap((void*) data, size);
+}
+
 namespace util {
   double mult_exp(double x, double y) {
     if(y == 0)
@@ -244,6 +244,16 @@ struct BinaryReader {
   }
 };
 
+// A file mapped read-only into memory, the system pages it in as it's read
+struct MappedFile {
+  explicit MappedFile(const std::string& file);
+  MappedFile(const MappedFile&) = delete;
+  ~MappedFile();
+
+  const char* data;
+  size_t size;
+};
+
 struct Progress {
   static bool enabled;
 
@@ -0,0 +1,88 @@
+#ifndef __VOICE_MODEL_HPP__
+#define __VOICE_MODEL_HPP__
+
+#include<array>
+#include<cassert>
+#include<string>
+#include<vector>
+
+#include"arena.hpp"
+#include"crf.hpp"
+#include"features.hpp"
+#include"speech_mod.hpp"
+
+// What decoding and synthesis read from a synthesis database: the
+// alphabet with its classes and the feature functions. Nothing changes
+// it once built, so any number of requests share one.
+struct VoiceModel {
+  explicit VoiceModel(const CRF& crf): crf(crf) { }
+
+  const PhonemeAlphabet& alphabet() const { return crf.alphabet(); }
+
+  // Its lambda are the coefficients new requests start with
+  const CRF& crf;
+};
+
+// One decode or synthesis on a model: the coefficients it decodes with
+// and the arena its temporaries come from. A context is used by one
+// thread at a time, contexts with different coefficients run side by
+// side on the same model.
+struct SynthesisContext {
+  explicit SynthesisContext(const VoiceModel& model, Arena* arena = 0)
+    : model(model), lambda(model.crf.lambda), arena(arena) { }
+  // The same request on another arena, usually the one of the thread
+  SynthesisContext(const SynthesisContext& other, Arena* arena)
+    : model(other.model), lambda(other.lambda), arena(arena) { }
+
+  void set(const std::string& feature, coefficient coef) {
+    auto i = 0u;
+    while(i < PhoneticFeatures::Names.size() && PhoneticFeatures::Names[i] != feature)
+      i++;
+    assert(i < PhoneticFeatures::Names.size());
+    lambda[i] = coef;
+  }
+
+  // The best path for input and the costs of the kBest best ones, only
+  // through the candidates of lattice if one is given
+  template<class Functions = MinPathFindFunctions, unsigned kBest = 1>
+  std::array<cost, kBest> decode(const std::vector<PhonemeInstance>& input,
+                                 std::vector<int>* path,
+                                 const Lattice* lattice = 0) const {
+    return traverse_automaton<Functions, CRF, kBest>(input, model.crf, lambda, path,
+                                                     0, lattice);
+  }
+
+  Lattice posteriors(const std::vector<PhonemeInstance>& input,
+                     double temperature = 1) const {
+    return ::posteriors<CRF>(input, model.crf, lambda, temperature);
+  }
+
+  cost concat_cost(const std::vector<PhonemeInstance>& output,
+                   const std::vector<PhonemeInstance>& input,
+                   CRF::Stats* stats = 0) const {
+    return ::concat_cost<CRF>(output, model.crf, lambda, input, stats);
+  }
+
+  cost concat_cost(const std::vector<int>& path,
+                   const std::vector<PhonemeInstance>& input,
+                   CRF::Stats* stats = 0) const {
+    return ::concat_cost<CRF>(path, model.crf, lambda, input, stats);
+  }
+
+  std::vector<PhonemeInstance> to_phonemes(const std::vector<int>& path) const {
+    return model.alphabet().to_phonemes(path);
+  }
+
+  // Keeps references to output and input
+  SpeechWaveSynthesis synthesis(const std::vector<PhonemeInstance>& output,
+                                const std::vector<PhonemeInstance>& input,
+                                Scheduler* scheduler = 0) const {
+    return SpeechWaveSynthesis(output, input, model.alphabet(), arena, scheduler);
+  }
+
+  const VoiceModel& model;
+  CRF::Values lambda;
+  Arena* arena;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define __WAV_HPP__
 
 #include<cassert>
+#include<cerrno>
 #include<cstdlib>
 #include<cstring>
 #include<iostream>
@@ -9,11 +10,44 @@
 #include<vector>
 #include<climits>
 #include<valarray>
+#include<functional>
+#include<memory>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/uio.h>
 
 #include"types.hpp"
+#include"arena.hpp"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 const unsigned DEFAULT_SAMPLE_RATE = 24000;
 
+// Writes all buffers to the file with as few writev calls as possible
+inline bool writeBuffers(const std::string& file, std::vector<iovec> buffers) {
+  int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return false;
+  auto first = 0u;
+  while(first < buffers.size()) {
+    int count = std::min(buffers.size() - first, (size_t) IOV_MAX);
+    auto written = writev(fd, &buffers[first], count);
+    if(written < 0 || (written == 0 && buffers[first].iov_len > 0))
+      break;
+    // Skip what was written, a partial write leaves a buffer half-way
+    for(; first < buffers.size() && written >= (ssize_t) buffers[first].iov_len; first++)
+      written -= buffers[first].iov_len;
+    if(first < buffers.size()) {
+      buffers[first].iov_base = (char*) buffers[first].iov_base + written;
+      buffers[first].iov_len -= written;
+    }
+  }
+  close(fd);
+  return first == buffers.size();
+}
+
 template<class Arr>
 unsigned uint_from_chars(Arr arr) {
   unsigned result = 0;
@@ -52,11 +86,16 @@ struct WaveData {
 
   template<class T>
   void plus(int i, T val) {
-    double newVal = this->data[i];
+    this->data[i] = addSaturated(this->data[i], val);
+  }
+
+  template<class T>
+  static short addSaturated(short sample, T val) {
+    double newVal = sample;
     newVal += val;
     newVal = std::max(newVal, (double) SHRT_MIN);
     newVal = std::min(newVal, (double) SHRT_MAX);
-    this->data[i] = (short) newVal;
+    return (short) newVal;
   }
   unsigned size() const { return length; }
 
@@ -97,16 +136,17 @@ struct WaveData {
     return std::round(duration * sampleRate);
   }
 
-  static WaveData copy(const WaveData& origin) {
+  // Arena data must not be deallocated, it goes with the arena
+  static WaveData copy(const WaveData& origin, Arena* arena = 0) {
     auto bytes = origin.length * sizeof(data[0]);
-    auto newData = (short*) malloc(bytes);
+    auto newData = arena ? arena->allocate_array<short>(origin.length) : (short*) malloc(bytes);
     memcpy(newData, origin.data + origin.offset, bytes);
     return WaveData(newData, 0, origin.length, origin.sampleRate);
   }
 
-  static WaveData allocate(double duration, unsigned sampleRate) {
+  static WaveData allocate(double duration, unsigned sampleRate, Arena* arena = 0) {
     int samples = duration * sampleRate;
-    auto newData = (short*) calloc(samples, sizeof(short));
+    auto newData = arena ? arena->calloc_array<short>(samples) : (short*) calloc(samples, sizeof(short));
     return WaveData(newData, 0, samples, sampleRate);
   }
 
@@ -177,8 +217,15 @@ struct Wave {
   Wave(): data(0) { }
   Wave(std::istream& istr):Wave() { read(istr); }
   Wave(const std::string& fileName):Wave() { read(fileName); }
+  Wave(Wave&& o): h(o.h), data(o.data) { o.data = 0; }
   ~Wave() { if(data) free(data); }
 
+  Wave& operator=(Wave&& o) {
+    std::swap(h, o.h);
+    std::swap(data, o.data);
+    return *this;
+  }
+
   WaveHeader h;
   char* data;
 
@@ -203,8 +250,7 @@ struct Wave {
   void write(const std::string& file) {
     if(file == "")
       return;
-    std::ofstream str(file);
-    write(str);
+    writeBuffers(file, {{ &h, sizeof(h) }, { data, h.samplesBytes }});
   }
 
   void write(std::ofstream& ostr) {
@@ -245,13 +291,36 @@ struct Wave {
   }
 };
 
+// Collects wave data without reallocating: either into a buffer reserved
+// up front, or into a chain of fixed-size chunks
 struct WaveBuilder {
+  static constexpr unsigned CHUNK_SIZE = 64 * 1024;
+
   WaveBuilder(WaveHeader h): h(h) {
-    data = 0;
     this->h.samplesBytes = 0;
   }
+  WaveBuilder(WaveHeader h, unsigned reserveBytes): WaveBuilder(h) {
+    reserve(reserveBytes);
+  }
+  WaveBuilder(const WaveBuilder&) = delete;
+  ~WaveBuilder() {
+    for(auto& c : chunks)
+      free(c.data);
+  }
+
+  struct Chunk {
+    char* data;
+    unsigned size, capacity;
+  };
+
   WaveHeader h;
-  char* data;
+  std::vector<Chunk> chunks;
+
+  // Known total length, the data then ends up in a single buffer
+  void reserve(unsigned bytes) {
+    if(bytes > free_space())
+      add_chunk(bytes - free_space());
+  }
 
   void append(const WaveData& w) {
     append((char*) (w.data + w.offset), w.length * sizeof(w.data[0]));
@@ -262,18 +331,175 @@ struct WaveBuilder {
   }
 
   void append(char* data, int count) {
-    this->data = (char*) realloc(this->data, h.samplesBytes + count);
-    memcpy(this->data + h.samplesBytes, data, count);
+    while(count > 0) {
+      if(free_space() == 0)
+        add_chunk(std::max((unsigned) count, (unsigned) CHUNK_SIZE));
+      auto& c = chunks.back();
+      auto n = std::min((unsigned) count, c.capacity - c.size);
+      memcpy(c.data + c.size, data, n);
+      c.size += n;
+      data += n;
+      count -= n;
+    }
+    h.setSampleBytes(size());
+  }
+
+  // Takes over a malloc'd buffer of samples without copying it
+  void adopt(WaveData& w) {
+    assert(w.offset == 0);
+    unsigned bytes = w.length * sizeof(w.data[0]);
+    chunks.push_back({ (char*) w.data, bytes, bytes });
+    w.data = 0;
+    h.setSampleBytes(size());
+  }
+
+  unsigned size() const {
+    unsigned result = 0;
+    for(auto& c : chunks)
+      result += c.size;
+    return result;
+  }
 
-    h.setSampleBytes(h.samplesBytes + count);
+  // Writes the header and all chunks without assembling them
+  bool write(const std::string& file) const {
+    std::vector<iovec> buffers {{ (void*) &h, sizeof(h) }};
+    for(auto& c : chunks)
+      buffers.push_back({ c.data, c.size });
+    return writeBuffers(file, buffers);
   }
 
+  // A single chunk is handed over as is, more are joined once
   Wave build() {
     Wave result;
     result.h = h;
-    result.data = this->data;
+    if(chunks.size() == 1) {
+      result.data = chunks[0].data;
+    } else {
+      result.data = (char*) malloc(h.samplesBytes);
+      auto offset = 0u;
+      for(auto& c : chunks) {
+        memcpy(result.data + offset, c.data, c.size);
+        offset += c.size;
+        free(c.data);
+      }
+    }
+    chunks.clear();
     return result;
   }
+
+private:
+  unsigned free_space() const {
+    return chunks.empty() ? 0 : chunks.back().capacity - chunks.back().size;
+  }
+
+  void add_chunk(unsigned capacity) {
+    chunks.push_back({ (char*) malloc(capacity), 0, capacity });
+  }
+};
+
+// Receives the samples of a wave in order, as soon as they are final
+struct WaveSink {
+  virtual ~WaveSink() { }
+
+  // The header may carry an unknown (maximal) length
+  virtual void begin(const WaveHeader& h) = 0;
+  virtual void write(const short* samples, int count) = 0;
+  virtual void finish() = 0;
+};
+
+// Streams to a file descriptor, patches the header on finish if it can seek
+struct FileWaveSink : public WaveSink {
+  FileWaveSink(int fd): fd(fd), owned(false), failed(fd < 0), written(0) { }
+  // "-" is the standard output
+  FileWaveSink(const std::string& file)
+    : fd(file == "-" ? STDOUT_FILENO : open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+      owned(file != "-"), failed(fd < 0), written(0) {
+    if(fd < 0)
+      std::cerr << "Cannot open " << file << std::endl;
+  }
+  FileWaveSink(const FileWaveSink&) = delete;
+  ~FileWaveSink() { if(owned && fd >= 0) close(fd); }
+
+  int fd;
+  bool owned;
+  // Set once opening or any write failed, nothing is written after that
+  bool failed;
+  unsigned written;
+  WaveHeader h;
+
+  bool ok() const { return !failed; }
+
+  void begin(const WaveHeader& h) {
+    this->h = h;
+    writeAll((const char*) &h, sizeof(h));
+  }
+
+  void write(const short* samples, int count) {
+    writeAll((const char*) samples, count * sizeof(samples[0]));
+    written += count * sizeof(samples[0]);
+  }
+
+  void finish() {
+    if(written == h.samplesBytes)
+      return;
+    h.setSampleBytes(written);
+    // Pipes and terminals keep the header as it was sent
+    if(!failed && lseek(fd, 0, SEEK_CUR) >= 0 &&
+       pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+      std::cerr << "Cannot patch wave header" << std::endl;
+      failed = true;
+    }
+  }
+
+private:
+  void writeAll(const char* bytes, size_t count) {
+    while(!failed && count > 0) {
+      auto n = ::write(fd, bytes, count);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0) {
+        std::cerr << "Cannot write wave data" << std::endl;
+        failed = true;
+        return;
+      }
+      bytes += n;
+      count -= n;
+    }
+  }
+};
+
+// Hands the samples on to another sink and keeps a copy of them
+struct CopyingWaveSink : public WaveSink {
+  CopyingWaveSink(WaveSink& sink): sink(sink) { }
+
+  WaveSink& sink;
+  std::unique_ptr<WaveBuilder> copy;
+
+  void begin(const WaveHeader& h) {
+    copy.reset(new WaveBuilder(h));
+    sink.begin(h);
+  }
+
+  void write(const short* samples, int count) {
+    copy->append((char*) samples, count * sizeof(samples[0]));
+    sink.write(samples, count);
+  }
+
+  void finish() { sink.finish(); }
+
+  Wave build() { return copy->build(); }
+};
+
+struct CallbackWaveSink : public WaveSink {
+  typedef std::function<void(const short*, int)> Callback;
+  CallbackWaveSink(Callback callback): callback(callback) { }
+
+  Callback callback;
+  WaveHeader h;
+
+  void begin(const WaveHeader& h) { this->h = h; }
+  void write(const short* samples, int count) { callback(samples, count); }
+  void finish() { }
 };
 
 struct SpeechWaveData : public WaveData {
@@ -282,7 +508,7 @@ struct SpeechWaveData : public WaveData {
   
   static constexpr auto EXTRA_TIME = 0.02;
   // Sample indexes that are pitch marks
-  std::vector<int> marks;
+  ArenaVector<int> marks;
   WaveData extra;
 
   SpeechWaveData& operator=(const WaveData& wd) {
@@ -293,19 +519,19 @@ struct SpeechWaveData : public WaveData {
     return *this;
   }
 
-  void init(const Wave& wav, double start, double end) {
+  void init(const Wave& wav, double start, double end, Arena* arena = 0) {
     auto extraStart = std::max(0.0, start - EXTRA_TIME);
     auto extraEnd = std::min(wav.duration(), end + EXTRA_TIME);
 
-    extra = WaveData::copy(wav.extractByTime(extraStart, extraEnd));
+    extra = WaveData::copy(wav.extractByTime(extraStart, extraEnd), arena);
     auto thisLen = extra.toSamples(end - start);
     auto thisOffsetInExtra = extra.toSamples(start - extraStart);
     *((WaveData*) this) = extra.range(thisOffsetInExtra, thisLen);
   }
 
-  static SpeechWaveData allocate(double duration, int sampleRate) {
+  static SpeechWaveData allocate(double duration, int sampleRate, Arena* arena = 0) {
     SpeechWaveData result;
-    result.extra = WaveData::allocate(duration + 2 * EXTRA_TIME, sampleRate);
+    result.extra = WaveData::allocate(duration + 2 * EXTRA_TIME, sampleRate, arena);
 
     result.data = result.extra.data;
     result.sampleRate = result.extra.sampleRate;
@@ -319,9 +545,9 @@ struct SpeechWaveData : public WaveData {
     WaveHeader h = WaveHeader::default_header();
     h.sampleRate = swd.sampleRate;
     h.byteRate = swd.sampleRate * 2;
-    WaveBuilder wb(h);
+    WaveBuilder wb(h, swd.length * sizeof(short));
     wb.append(swd);
-    wb.build().write(file);
+    wb.write(file);
   }
   static void toFile(SpeechWaveData& swd) {
     SpeechWaveData::toFile(swd, "swd.wav");
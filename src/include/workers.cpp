@@ -0,0 +1,199 @@
+#include<algorithm>
+#include<cerrno>
+#include<cstdint>
+#include<dirent.h>
+#include<iostream>
+#include<sys/socket.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
+#include"workers.hpp"
+#include"util.hpp"
+
+namespace {
+  bool sendAll(int socket, const char* data, size_t size) {
+    while(size > 0) {
+      auto sent = send(socket, data, size, MSG_NOSIGNAL);
+      if(sent < 0 && errno == EINTR)
+        continue;
+      if(sent <= 0)
+        return false;
+      data += sent;
+      size -= sent;
+    }
+    return true;
+  }
+
+  // False if the other end closed or failed before size bytes came
+  bool readAll(int socket, char* data, size_t size) {
+    while(size > 0) {
+      auto count = read(socket, data, size);
+      if(count < 0 && errno == EINTR)
+        continue;
+      if(count <= 0)
+        return false;
+      data += count;
+      size -= count;
+    }
+    return true;
+  }
+
+  // Messages are their size followed by their bytes
+  bool sendMessage(int socket, const std::string& message) {
+    uint64_t size = message.size();
+    return sendAll(socket, (const char*) &size, sizeof(size)) &&
+      sendAll(socket, message.data(), message.size());
+  }
+
+  bool receiveMessage(int socket, std::string* message) {
+    uint64_t size;
+    if(!readAll(socket, (char*) &size, sizeof(size)))
+      return false;
+    message->resize(size);
+    return readAll(socket, &(*message)[0], size);
+  }
+
+  // Replies start with whether the job succeeded
+  bool sendReply(int socket, bool ok, const std::string& reply) {
+    char status = ok;
+    return sendAll(socket, &status, 1) && sendMessage(socket, reply);
+  }
+
+  // Threads of this process, 0 if it can't tell
+  unsigned threadCount() {
+    auto dir = opendir("/proc/self/task");
+    if(!dir)
+      return 0;
+    auto count = 0u;
+    while(auto entry = readdir(dir))
+      if(entry->d_name[0] != '.')
+        count++;
+    closedir(dir);
+    return count;
+  }
+}
+
+WorkerPool::WorkerPool(unsigned count, Handler handler) {
+  // Only the forking thread would exist in the workers, with whatever
+  // the others held locked
+  auto threads = threadCount();
+  if(threads != 1) {
+    ERROR("Not starting workers, the process has " << threads << " threads");
+    return;
+  }
+
+  // Buffered output would be written by the workers as well
+  std::cout.flush();
+  std::cerr.flush();
+
+  for(auto i = 0u; i < count; i++) {
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      ERROR("Could not create a socket for worker " << i);
+      break;
+    }
+
+    auto pid = fork();
+    if(pid == 0) {
+      close(fds[0]);
+      for(auto s : sockets)
+        close(s);
+      supervise(fds[1], handler);
+    }
+    close(fds[1]);
+    if(pid < 0) {
+      ERROR("Could not fork worker " << i);
+      close(fds[0]);
+      break;
+    }
+    sockets.push_back(fds[0]);
+    pids.push_back(pid);
+  }
+  INFO("Started " << sockets.size() << " workers");
+}
+
+WorkerPool::~WorkerPool() {
+  for(auto s : sockets)
+    close(s);
+  for(auto pid : pids) {
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  }
+}
+
+void WorkerPool::supervise(int socket, const Handler& handler) {
+  while(true) {
+    auto pid = fork();
+    if(pid < 0) {
+      ERROR("Worker " << getpid() << " could not fork");
+      _exit(1);
+    }
+    if(pid == 0) {
+      serve(socket, handler);
+      _exit(0);
+    }
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    // It only exits by itself once the socket is closed
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      _exit(0);
+
+    WARN("Worker " << getpid() << " lost its job process, starting another one");
+    if(!sendReply(socket, false, ""))
+      _exit(1);
+  }
+}
+
+void WorkerPool::serve(int socket, const Handler& handler) {
+  std::string job;
+  while(receiveMessage(socket, &job)) {
+    std::string reply;
+    auto ok = true;
+    try {
+      reply = handler(job);
+    } catch(std::exception& e) {
+      ERROR("Job failed: " << e.what());
+      ok = false;
+      reply.clear();
+    }
+    if(!sendReply(socket, ok, reply))
+      return;
+  }
+}
+
+std::vector<WorkerPool::Status> WorkerPool::run(const std::vector<std::string>& jobs,
+                                                std::vector<std::string>* replies) {
+  std::lock_guard<std::mutex> lock(mutex);
+  replies->assign(jobs.size(), std::string());
+  std::vector<Status> result(jobs.size(), LOST);
+  auto count = std::min(jobs.size(), sockets.size());
+
+  // Jobs are small, all of them go out before waiting for any reply
+  std::vector<bool> sent(count);
+  for(auto i = 0u; i < count; i++)
+    sent[i] = sendMessage(sockets[i], jobs[i]);
+
+  std::vector<bool> lost(sockets.size(), false);
+  for(auto i = 0u; i < count; i++) {
+    char status;
+    if(!sent[i] || !readAll(sockets[i], &status, 1) ||
+       !receiveMessage(sockets[i], &(*replies)[i])) {
+      ERROR("Worker " << i << " is gone");
+      (*replies)[i].clear();
+      lost[i] = true;
+      continue;
+    }
+    result[i] = status ? DONE : FAILED;
+  }
+
+  // The next jobs only go to the ones left
+  auto left = 0u;
+  for(auto i = 0u; i < sockets.size(); i++)
+    if(lost[i])
+      close(sockets[i]);
+    else
+      sockets[left++] = sockets[i];
+  sockets.resize(left);
+  return result;
+}
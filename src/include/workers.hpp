@@ -0,0 +1,78 @@
+#ifndef __WORKERS_HPP__
+#define __WORKERS_HPP__
+
+#include<cassert>
+#include<cstring>
+#include<functional>
+#include<mutex>
+#include<string>
+#include<sys/types.h>
+#include<vector>
+
+// Processes forked from this one that run jobs for it. They share
+// everything loaded before the fork with it, copy on write. Each worker
+// is a small process that forks the one running the jobs and forks a
+// new one when it dies, so a crash only fails the job it was running.
+// Build it before starting any thread, no worker is started if the
+// process has others.
+struct WorkerPool {
+  // The reply to a job, run in the workers
+  typedef std::function<std::string(const std::string&)> Handler;
+
+  WorkerPool(unsigned count, Handler handler);
+  // Workers exit once they see their socket closed
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // FAILED if the job threw or crashed the process running it, LOST if
+  // the worker itself is gone and won't take more jobs
+  enum Status { DONE, FAILED, LOST };
+
+  // Workers still running
+  unsigned size() const { return sockets.size(); }
+
+  // jobs[i] runs on the i-th worker still running, all at once. Jobs
+  // past the last of them are LOST. Replies are empty unless DONE.
+  std::vector<Status> run(const std::vector<std::string>& jobs,
+                          std::vector<std::string>* replies);
+
+private:
+  static void supervise(int socket, const Handler& handler);
+  static void serve(int socket, const Handler& handler);
+
+  std::vector<int> sockets;
+  std::vector<pid_t> pids;
+  // Held for a whole round, callers take turns with all of the workers
+  std::mutex mutex;
+};
+
+// Plain values in and out of the messages of jobs, workers run the
+// same binary on the same architecture
+struct MessageWriter {
+  template<class T>
+  void put(const T& value) {
+    data.append((const char*) &value, sizeof(value));
+  }
+
+  std::string data;
+};
+
+struct MessageReader {
+  explicit MessageReader(const std::string& data): data(data), pos(0) { }
+
+  template<class T>
+  T get() {
+    T value;
+    assert(pos + sizeof(value) <= data.size());
+    std::memcpy(&value, data.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+  }
+
+  const std::string& data;
+  size_t pos;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include<fstream>
 #include<algorithm>
 #include<string>
+#include<thread>
 #include<ios>
 #include<unistd.h>
 #include<iomanip>
@@ -10,18 +11,39 @@
 #include"features.hpp"
 #include"speech_mod.hpp"
 #include"gridsearch.hpp"
+#include"voice_model.hpp"
 #include"csv.hpp"
+#include"scheduler.hpp"
 
 void print_usage() {
     std::cerr << "Usage: <cmd> <options>\n";
     std::cerr << "--mode [synth|query]\n";
     std::cerr << "--synth-database <bin_db_file>\n";
     std::cerr << "--test-database <bin_db_file>\n";
+    std::cerr << "--manifest <file> (compare-batch only, a pair of WAV files per line, as --i and --o)\n";
     std::cerr << "--input <input_string>\n";
     std::cerr << "--textgrid <textgrid_output>\n";
     std::cerr << "--phonid (query only)\n";
     std::cerr << "--concat-cost (query only)\n";
     std::cerr << "--verbose\n";
+    std::cerr << "--stream (resynth only, writes the output unit by unit)\n";
+    std::cerr << "--couple (resynth only, not with --stream, moves unit boundaries to the best joins)\n";
+    std::cerr << "--join-xcorr (aligns coupled units by cross-correlation)\n";
+    std::cerr << "--psola-threads <n> (resynth and psola, overlap-adds the units on n threads)\n";
+    std::cerr << "--score-cache <file> (train only, keeps comparison scores across runs)\n";
+    std::cerr << "--no-incremental (train only, synthesizes and compares every path in full)\n";
+    std::cerr << "--reference-spill <file> (train only, keeps reference features in a mapped file)\n";
+    std::cerr << "--search-points <n> (train only, points of a line search tried at once, spread over the bracket)\n";
+    std::cerr << "--explore-directions (train only, searches both directions of an axis at once)\n";
+    std::cerr << "--explore-axes (train only, searches all axes in both directions at once)\n";
+    std::cerr << "--trainer grid|perceptron|margin (train only, learns the coefficients from decoded paths)\n";
+    std::cerr << "--learning-rate <r>, --max-step <c>, --loss-scale <s> (perceptron and margin trainers)\n";
+    std::cerr << "--acoustic-loss (perceptron and margin trainers, scores decoded paths by the metric)\n";
+    std::cerr << "--prune-mass <p> (train only, decodes through the candidates holding p of the posterior at the start)\n";
+    std::cerr << "--posterior-temperature <t> (train only, posteriors are exp(-cost / t))\n";
+    std::cerr << "--minibatch <n> (train only, compares points n sentences at a time and gives up on worse ones)\n";
+    std::cerr << "--rejection-z <z>, --minibatch-seed <s> (with --minibatch, confidence bound and sentence order)\n";
+    std::cerr << "--workers <n> (train only, decodes and compares in n forked processes sharing the databases, the searches of --explore-directions/--explore-axes take turns on them)\n";
     std::cerr << "synth reads input from the input file path or stdin if - is passed\n";
 }
 
@@ -84,14 +106,23 @@ void outputComparisons(const Options& opts,
            cmp.MFCC, cmp.WSS, baselineCost);
 }
 
-void readCoefOptions(const Options& opts) {
+void readCoefOptions(const Options& opts, SynthesisContext& context) {
   for(auto name : PhoneticFeatures::Names) {
-    crf.set(name, opts.get_opt<double>(name, 0) / opts.get_opt("norm-" + name, 1.0));
+    context.set(name, opts.get_opt<double>(name, 0) / opts.get_opt("norm-" + name, 1.0));
   }
 }
 
+// Where the units of a resynthesis are overlap-added, on the calling
+// thread unless --psola-threads asks for more
+std::unique_ptr<Scheduler> psolaScheduler(const Options& opts) {
+  auto threads = opts.get_opt<unsigned>("psola-threads", 1);
+  return std::unique_ptr<Scheduler>(threads > 1 ? new Scheduler(threads) : 0);
+}
+
 int resynthesize(Options& opts) {
-  readCoefOptions(opts);
+  VoiceModel model(crf);
+  SynthesisContext context(model);
+  readCoefOptions(opts, context);
 
   auto index = util::parse<unsigned>(opts.input);
   auto corpus = get_corpus(opts);
@@ -100,31 +131,54 @@ int resynthesize(Options& opts) {
 
   INFO("Input file: " << alphabet_test.file_data_of(input[0]).file);
   INFO("Total duration: " << get_total_duration(input));
-  INFO("Original cost: " << concat_cost(input, crf, crf.lambda, input));
+  INFO("Original cost: " << context.concat_cost(input, input));
 
   std::vector<int> path;
-  traverse_automaton<MinPathFindFunctions, CRF, 1>(input, crf, crf.lambda, &path);
+  context.decode(input, &path);
 
-  std::vector<PhonemeInstance> output = crf.alphabet().to_phonemes(path);
+  std::vector<PhonemeInstance> output = context.to_phonemes(path);
 
   SynthPrinter sp(crf.alphabet(), labels_all);
-  if(opts.has_opt("verbose"))
-    sp.print_synth(path, input);
+  if(opts.has_opt("verbose")) {
+    // Not into a wave written to the standard output
+    if(opts.get_opt<std::string>("output", "") == "-")
+      sp.print_synth(path, input, std::cerr);
+    else
+      sp.print_synth(path, input);
+  }
   sp.print_textgrid(path, input, labels_synth, opts.text_grid);
 
   CRF::Stats stats;
-  INFO("Resynth. cost: " << concat_cost(output, crf, crf.lambda, input, &stats));
+  INFO("Resynth. cost: " << context.concat_cost(output, input, &stats));
   //INFO("Second best cost: " << costs[1]);
   auto baselineCost = concat_cost(output, baseline_crf, baseline_crf.lambda, input);
   INFO("Baseline cost: " << baselineCost);
 
-  outputStats(crf.lambda, stats, opts);
+  outputStats(context.lambda, stats, opts);
   outputPath(opts, output, input);
 
-  auto sws = SpeechWaveSynthesis(output, input, crf.alphabet());
-  Wave outputSignal = sws.get_resynthesis(opts);
-
-  outputSignal.write(opts.get_opt<std::string>("output", "resynth.wav"));
+  auto psola = psolaScheduler(opts);
+  auto sws = context.synthesis(output, input, psola.get());
+  auto outputFile = opts.get_opt<std::string>("output", "resynth.wav");
+  Wave outputSignal;
+  if(opts.has_opt("stream")) {
+    FileWaveSink file(outputFile);
+    // Compared below without reading it back, it may be the standard output
+    CopyingWaveSink copy(file);
+    if(opts.has_opt("verbose"))
+      sws.stream_resynthesis(opts, copy);
+    else
+      sws.stream_resynthesis(opts, file);
+    if(!file.ok()) {
+      ERROR("Could not write " << outputFile);
+      return 1;
+    }
+    if(opts.has_opt("verbose"))
+      outputSignal = copy.build();
+  } else {
+    outputSignal = sws.get_resynthesis(opts);
+    outputSignal.write(outputFile);
+  }
 
   auto sws2 = SpeechWaveSynthesis(input, input, alphabet_test);
   auto concatenation = sws2.get_concatenation();
@@ -144,7 +198,9 @@ int resynthesize(Options& opts) {
 }
 
 int baseline(const Options& opts) {
-  readCoefOptions(opts);
+  VoiceModel model(crf);
+  SynthesisContext context(model);
+  readCoefOptions(opts, context);
 
   auto index = opts.get_opt<unsigned>("input", 0);
   auto corpus = get_corpus(opts);
@@ -168,11 +224,11 @@ int baseline(const Options& opts) {
   concatenation.write(opts.get_opt<std::string>("original", "original.wav"));
 
   CRF::Stats stats;
-  INFO("Baseline cost in original: " << concat_cost(output, crf, crf.lambda, input, &stats));
+  INFO("Baseline cost in original: " << context.concat_cost(output, input, &stats));
   auto baselineCost = concat_cost(output, baseline_crf, baseline_crf.lambda, input);
   INFO("Baseline cost:" << baselineCost);
 
-  outputStats(crf.lambda, stats, opts);
+  outputStats(context.lambda, stats, opts);
   outputPath(opts, output, input);
 
   if(opts.has_opt("verbose")) {
@@ -230,6 +286,71 @@ int compare(const Options& opts) {
   return 0;
 }
 
+// Pairs of files compared as by compare, without the frame values,
+// all of them in one table
+int compareBatch(const Options& opts) {
+  auto manifest = opts.get_opt<std::string>("manifest", "");
+  std::ifstream s(manifest);
+  if(!s) {
+    ERROR("Can't read manifest " << manifest);
+    return 1;
+  }
+
+  std::vector<std::pair<std::string, std::string> > pairs;
+  std::string line;
+  while(std::getline(s, line)) {
+    std::istringstream ls(line);
+    std::string inputFile, outputFile;
+    if(!(ls >> inputFile) || inputFile[0] == '#')
+      continue;
+    if(!(ls >> outputFile)) {
+      ERROR("Nothing to compare " << inputFile << " with");
+      return 1;
+    }
+    pairs.emplace_back(inputFile, outputFile);
+  }
+
+  std::vector<Comparisons> results(pairs.size());
+  // Not a vector<bool>, every thread writes its own elements
+  std::vector<char> compared(pairs.size(), false);
+  auto threads = opts.get_opt<unsigned>("thread-count", std::thread::hardware_concurrency());
+  Scheduler scheduler(threads);
+  parallel_for(scheduler, 0, pairs.size(), [&](unsigned k) {
+      auto& pair = pairs[k];
+      if(!std::ifstream(pair.first) || !std::ifstream(pair.second)) {
+        ERROR("Can't read " << pair.first << " or " << pair.second);
+        return;
+      }
+      auto w1 = Wave(pair.first);
+      auto w2 = Wave(pair.second);
+      results[k].fill(w1, w2);
+      compared[k] = true;
+    });
+
+  auto output = CSVOutput<7>(opts.get_opt<std::string>("output", "comparisons.csv"));
+  output.all_headers("i", "o",
+                     "LogSpectrum",
+                     "LogSpectrumCritical",
+                     "SegSNR",
+                     "MFCC",
+                     "WSS");
+  auto count = 0u;
+  for(auto k = 0u; k < pairs.size(); k++) {
+    if(!compared[k])
+      continue;
+    auto& cmp = results[k];
+    output.print(pairs[k].first, pairs[k].second,
+                 cmp.LogSpectrum,
+                 cmp.LogSpectrumCritical,
+                 cmp.SegSNR,
+                 cmp.MFCC,
+                 cmp.WSS);
+    count++;
+  }
+  INFO("Compared " << count << " of " << pairs.size() << " pairs");
+  return count == pairs.size() ? 0 : 1;
+}
+
 int psola(const Options& opts) {
   auto inputString = opts.get_opt<std::string>("input", "");
   auto inputPhonemes = util::split_string(inputString, ',');
@@ -261,7 +382,8 @@ int psola(const Options& opts) {
     phonemeOutput.push_back(p);
   }
 
-  auto sws = SpeechWaveSynthesis(phonemeInput, phonemeOutput, alphabet);
+  auto psola = psolaScheduler(opts);
+  auto sws = SpeechWaveSynthesis(phonemeInput, phonemeOutput, alphabet, 0, psola.get());
   auto outputSignal = sws.get_resynthesis(opts);
   auto original = sws.get_concatenation();
   original.write(opts.get_opt<std::string>("original", ""));
@@ -321,6 +443,8 @@ int main(int argc, const char** argv) {
     return baseline(opts);
   case Options::Mode::COMPARE:
     return compare(opts);
+  case Options::Mode::COMPARE_BATCH:
+    return compareBatch(opts);
   case Options::Mode::COUPLE:
     return couple(opts);
   case Options::Mode::PSOLA:
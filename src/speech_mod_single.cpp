@@ -8,7 +8,6 @@
 #include"tool.hpp"
 #include"crf.hpp"
 #include"features.hpp"
-#include"threadpool.h"
 #include"speech_mod.hpp"
 
 void resynth(int argc, const char** argv) {
@@ -1,11 +1,16 @@
 #include<fstream>
 #include<sstream>
 #include<cstdlib>
+#include<unistd.h>
 
 #include"gridsearch.hpp"
 #include"parser.hpp"
 #include"speech_synthesis.hpp"
 #include"crf.hpp"
+#include"mfcc.hpp"
+#include"score_cache.hpp"
+#include"scheduler.hpp"
+#include"workers.hpp"
 
 using namespace gridsearch;
 
@@ -32,6 +37,10 @@ struct TestAlphabet : LabelAlphabet<TestObject> {
     return classes[integer % CLASSES];
   }
 
+  const LabelClass& get_class(unsigned int integer, LabelClass&) const {
+    return get_class(integer);
+  }
+
   bool allowedState(const Label& l1, const Label& l2) const {
     return l1.label % CLASSES == l2.label % CLASSES;
   }
@@ -74,6 +83,25 @@ void assertEquals(T expected, T actual) {
   assertEquals(std::string(""), expected, actual);
 }
 
+// Relative to the expected value
+void assertNear(double expected, double actual, double tolerance) {
+  if(std::fabs(actual - expected) > tolerance * std::fabs(expected)) {
+    ERROR("Expected " << expected << ", actual " << actual);
+    ERROR("Assert failed: not within " << tolerance); assert(false);
+  }
+}
+
+// A new empty file in the temporary directory, the test unlinks it
+std::string tempFile(const std::string& name) {
+  auto dir = getenv("TMPDIR");
+  auto path = std::string(dir ? dir : "/tmp") + "/" + name + "-XXXXXX";
+  auto fd = mkstemp(&path[0]);
+  if(fd < 0)
+    throw std::string("Can't create " + path);
+  close(fd);
+  return path;
+}
+
 void testUtils() {
   std::cerr << "Multiplication: " << util::mult(-0.0001, 0.0001) << std::endl;
   std::cerr << "ExpMultiplication: " << util::mult_exp(0, -0.0001) << std::endl;
@@ -179,6 +207,97 @@ void testCrfPathLength1() {
   assertEquals("Element", x[0], best_path[0]);
 }
 
+void testDecoderWorkspace() {
+  TestCRF crf;
+  crf.label_alphabet = new TestAlphabet();
+  crf.lambda = {{1.0f}};
+  DecoderWorkspace<2> workspace;
+
+  vector<int> x{0, 1, 2, 0, 1}, path;
+  traverse_automaton<MinPathFindFunctions, TestCRF, 2>(x, crf, crf.lambda,
+                                                       &path, &workspace);
+  verifyPath(x, path);
+  auto paths = workspace.paths.data.get();
+
+  // Shorter inputs reuse the memory of longer ones
+  vector<int> y{2, 1};
+  auto costs = traverse_automaton<MinPathFindFunctions, TestCRF, 2>(y, crf, crf.lambda,
+                                                                    &path, &workspace);
+  verifyPath(y, path);
+  assertEquals("Cost", 0.0 - y.size(), costs[0]);
+  assertEquals(paths, workspace.paths.data.get());
+}
+
+void testPosteriors() {
+  TestCRF crf;
+  crf.label_alphabet = new TestAlphabet();
+  crf.lambda = {{1.0f}};
+
+  // Each position costs -1 for its own label and 1 for the other two
+  vector<int> x{0, 1, 2, 0, 1}, path;
+  auto lattice = posteriors(x, crf, crf.lambda);
+  assertNear(x.size() * std::log(std::exp(1) + 2 * std::exp(-1)), lattice.logZ, 1e-12);
+  for(auto pos = 0u; pos < x.size(); pos++) {
+    auto& p = lattice.posteriors[pos];
+    assertEquals(3ul, p.size());
+    assertNear(1.0, p[0] + p[1] + p[2], 1e-12);
+    for(auto m = 0u; m < p.size(); m++)
+      if(lattice.candidates[pos][m] == x[pos])
+        assertNear(std::exp(2) / (std::exp(2) + 2), p[m], 1e-12);
+  }
+
+  lattice.prune(0.5);
+  assertEquals(x.size(), lattice.size());
+  auto costs = traverse_automaton<MinPathFindFunctions, TestCRF, 1>(x, crf, crf.lambda,
+                                                                    &path, 0, &lattice);
+  verifyPath(x, path);
+  assertEquals("Cost", 0.0 - x.size(), costs[0]);
+}
+
+void testEarlyRejection() {
+  EarlyRejection r(2, 2, 1, 10);
+  // Too few to tell, or nothing left to save
+  assertEquals(false, r.worse({ 5 }));
+  assertEquals(false, r.worse(std::vector<double>(10, 5)));
+  // Clearly worse on every sentence so far
+  assertEquals(true, r.worse({ 5, 6, 4, 5 }));
+  // Worse on some, better on others
+  assertEquals(false, r.worse({ 5, -4, 3, -6 }));
+  assertEquals(false, r.worse({ 0, 0, 0, 0 }));
+
+  // The same sentences come first for every point
+  EarlyRejection same(2, 2, 1, 10);
+  assertEquals(true, r.order == same.order);
+
+  auto outputs = [](std::vector<double> values) {
+    TrainingOutputs result;
+    for(auto v : values) {
+      result.emplace_back();
+      result.back().cmp = v;
+    }
+    return result;
+  };
+  r.update(outputs({ 3, 3 }));
+  assertEquals(true, r.best() == std::vector<double>({ 3, 3 }));
+
+  // Better points of a wave only count after it, in any order
+  for(auto reversed : { false, true }) {
+    EarlyRejection w(2, 2, 1, 2);
+    w.update(outputs({ 3, 3 }));
+    w.beginWave();
+    std::vector<TrainingOutputs> points = { outputs({ 1, 2 }), outputs({ 2, 1 }),
+                                            outputs({ 2, 2 }) };
+    if(reversed)
+      std::reverse(points.begin(), points.end());
+    for(auto& p : points) {
+      w.update(p);
+      assertEquals(true, w.best() == std::vector<double>({ 3, 3 }));
+    }
+    w.endWave();
+    assertEquals(true, w.best() == std::vector<double>({ 1, 2 }));
+  }
+}
+
 extern void printGridPoint(std::string file, const Params& params, const TrainingOutputs& result);
 extern GridPoints parseGridPoints(std::string file);
 
@@ -218,13 +337,405 @@ void testGridPrint() {
   }
 }
 
+void testWaveBuilder() {
+  const int count = WaveBuilder::CHUNK_SIZE;
+  std::vector<short> samples(count);
+  for(auto i = 0; i < count; i++)
+    samples[i] = i;
+  WaveData wd(samples.data(), 0, count, DEFAULT_SAMPLE_RATE);
+
+  // Chained chunks and a reserved buffer end up with the same data
+  WaveBuilder chained(WaveHeader::default_header());
+  WaveBuilder reserved(WaveHeader::default_header(), 3 * count * sizeof(short));
+  for(auto i = 0; i < 3; i++) {
+    chained.append(wd.range(0, count));
+    reserved.append(wd.range(0, count));
+  }
+  assertEquals(3ul, chained.chunks.size());
+  assertEquals(1ul, reserved.chunks.size());
+
+  auto file = tempFile("test-wave");
+  chained.write(file);
+  Wave fromChunks(file);
+  unlink(file.c_str());
+  Wave fromBuffer = reserved.build();
+  assertEquals(fromBuffer.length(), fromChunks.length());
+  for(auto i = 0u; i < fromBuffer.length(); i++)
+    assertEquals(samples[i % count], fromChunks[i]);
+  assertEquals(0, memcmp(fromBuffer.data, fromChunks.data, fromBuffer.h.samplesBytes));
+}
+
+void testArena() {
+  Arena arena;
+  auto marker = arena.mark();
+  {
+    ArenaScope scope(arena);
+    ArenaVector<int> marks(&arena);
+    for(auto i = 0; i < 1000; i++)
+      marks.push_back(i);
+    auto wd = WaveData::allocate(1, DEFAULT_SAMPLE_RATE, &arena);
+    assertEquals(0, (int) wd[wd.length - 1]);
+    // Larger than a block
+    arena.allocate_array<short>(Arena::BLOCK_SIZE);
+  }
+  auto capacity = arena.capacity();
+  assertEquals(marker.block, arena.mark().block);
+  assertEquals(marker.used, arena.mark().used);
+
+  // The blocks are kept for the next round
+  {
+    ArenaScope scope(arena);
+    arena.allocate_array<short>(Arena::BLOCK_SIZE);
+  }
+  assertEquals(capacity, arena.capacity());
+}
+
+void testMFCCExtractor() {
+  const unsigned size = 512, sampleRate = 16000;
+  double spectrum[size];
+  for(auto i = 0u; i < size; i++)
+    spectrum[i] = std::sin(0.05 * i) * 100 + (i % 11);
+
+  double coefs[5];
+  MFCCExtractor::get(sampleRate, size, 42).compute(spectrum, coefs, 5);
+  for(auto i = 0u; i < 5; i++)
+    assertEquals(GetCoefficient(spectrum, sampleRate, 42, size, i + 1), coefs[i]);
+}
+
+void testIncrementalComparison() {
+  const int count = 4000;
+  std::vector<short> original(count), changed(count);
+  for(auto i = 0; i < count; i++) {
+    original[i] = 3000 * std::sin(0.03 * i);
+    changed[i] = 2000 * std::sin(0.05 * i) + (i % 7);
+  }
+  auto build = [&](std::vector<short>& samples) {
+    WaveBuilder wb(WaveHeader::default_header());
+    wb.append(WaveData(samples.data(), 0, count, DEFAULT_SAMPLE_RATE));
+    return wb.build();
+  };
+  auto frames = toFFTdFrames(build(original));
+  ComparisonReference reference(build(original), toFFTdFrames(build(original)),
+                                DEFAULT_SAMPLE_RATE, METRIC_WSS);
+
+  IncrementalComparison incremental(reference, DEFAULT_SAMPLE_RATE, METRIC_WSS);
+  std::vector<short> samples(changed);
+  WaveData signal(samples.data(), 0, count, DEFAULT_SAMPLE_RATE);
+  assertEquals(compare_WSS(build(samples), frames),
+               incremental.update(signal, { }));
+  assertEquals(compare_WSS(build(samples), frames),
+               reference.compare(build(samples), "WSS"));
+
+  // Only the frames over the changed samples are scored again
+  for(auto i = 1500; i < 1700; i++)
+    samples[i] = original[i];
+  assertEquals(compare_WSS(build(samples), frames),
+               incremental.update(signal, { std::make_pair(1500, 1700) }));
+
+  // Read back from a file, the features are the same
+  auto file = tempFile("test-reference");
+  {
+    std::ofstream s(file, std::ios::binary);
+    s.write(reference.begin(), reference.bytes());
+  }
+  reference.map(std::make_shared<MappedFile>(file), 0);
+  // Mapped, the features outlive the name
+  unlink(file.c_str());
+  assertEquals(compare_WSS(build(samples), frames),
+               reference.compare(build(samples), "WSS"));
+}
+
+// Paths that change a few units at a time update to the same samples
+// as a full resynthesis of each
+void testIncrementalResynthesis() {
+  const int rate = DEFAULT_SAMPLE_RATE;
+  std::vector<short> samples(rate);
+  FileData fd;
+  fd.file = tempFile("test-units");
+  auto phase = 0.0;
+  for(auto i = 0; i < rate; i++) {
+    auto prev = phase;
+    phase += (110 + 30 * i / rate) / (double) rate;
+    if(std::floor(phase) != std::floor(prev))
+      fd.pitch_marks.push_back(i / (double) rate);
+    samples[i] = 5000 * std::sin(2 * M_PI * phase) + 1500 * std::sin(6 * M_PI * phase);
+  }
+  WaveBuilder wb(WaveHeader::default_header());
+  wb.append(WaveData(samples.data(), 0, rate, rate));
+  wb.build().write(fd.file);
+
+  PhonemeAlphabet alphabet;
+  alphabet.files.push_back(fd);
+  std::vector<PhonemeInstance> units(9);
+  for(auto k = 0u; k < units.size(); k++) {
+    auto& u = units[k];
+    u.id = k;
+    u.start = 0.02 + 0.1 * k;
+    u.duration = 0.06 + 0.01 * (k % 4);
+    u.end = u.start + u.duration;
+    alphabet.file_indices.push_back(0);
+  }
+
+  std::vector<PhonemeInstance> target(5);
+  for(auto k = 0u; k < target.size(); k++) {
+    target[k].duration = 0.07 + 0.01 * k;
+    target[k].pitch_contour[0] = std::log(100 + 10 * k);
+    target[k].pitch_contour[1] = std::log(105 + 10 * k);
+  }
+
+  IncrementalResynthesis state;
+  std::vector<int> last;
+  for(auto& path : std::vector<std::vector<int> >{ {0, 1, 2, 3, 4}, {0, 1, 5, 3, 4},
+                                                   {6, 1, 5, 3, 7}, {6, 1, 5, 3, 7},
+                                                   {8, 2, 1, 0, 4} }) {
+    std::vector<PhonemeInstance> source;
+    for(auto id : path)
+      source.push_back(units[id]);
+    SpeechWaveSynthesis(source, target, alphabet).update_resynthesis_td(state);
+    auto full = SpeechWaveSynthesis(source, target, alphabet).get_resynthesis_td();
+    // The same path again changes nothing
+    assertEquals(path == last, state.changed.empty());
+    last = path;
+
+    assertEquals((unsigned) full.length(), (unsigned) state.samples.size());
+    auto energy = 0.0;
+    for(auto i = 0u; i < full.length(); i++) {
+      assertEquals(full[i], state.samples[i]);
+      energy += std::abs(full[i]);
+    }
+    assert(energy > 0);
+  }
+  unlink(fd.file.c_str());
+}
+
+// Metrics of two fixed signals in double precision, a build with
+// FLOAT_ANALYSIS has to stay within a tolerance of them
+void testAnalysisPrecision() {
+  const int count = 6000;
+  std::vector<short> original(count), result(count);
+  for(auto i = 0; i < count; i++) {
+    original[i] = 3000 * std::sin(0.03 * i) + 800 * std::sin(0.31 * i);
+    result[i] = 2500 * std::sin(0.031 * i) + 900 * std::sin(0.29 * i) + (i % 13);
+  }
+  auto build = [&](std::vector<short>& samples) {
+    WaveBuilder wb(WaveHeader::default_header());
+    wb.append(WaveData(samples.data(), 0, count, DEFAULT_SAMPLE_RATE));
+    return wb.build();
+  };
+  SpectralAnalysis a(build(result), METRIC_SPECTRAL), b(build(original), METRIC_SPECTRAL);
+  auto scores = compare_spectra(a, b, METRIC_SPECTRAL);
+  assertNear(692.45403535183948, scores.LogSpectrum, 1e-2);
+  assertNear(48.679324342937356, scores.LogSpectrumCritical, 1e-2);
+  assertNear(29.972487932869466, scores.MFCC, 1e-2);
+  assertNear(169.81490874866003, scores.WSS, 1e-2);
+}
+
+void testScoreCache() {
+  ScoreCache cache;
+  std::vector<int> path = { 1, 2, 3 }, other = { 3, 2, 1 };
+  double score;
+  cache.add(0, path, "MFCC", 1.5);
+  cache.add(1, other, "MFCC", 1.0 / 3);
+  assertEquals(false, cache.find(0, other, "MFCC", score));
+  assertEquals(false, cache.find(0, path, "WSS", score));
+  assertEquals(true, cache.find(0, path, "MFCC", score));
+  assertEquals(1.5, score);
+
+  auto file = tempFile("test-scores");
+  cache.save(file, "tag");
+  ScoreCache loaded;
+  assertEquals(false, loaded.load(file, "other tag"));
+  assertEquals(true, loaded.load(file, "tag"));
+  assertEquals(2ul, loaded.size());
+  assertEquals(true, loaded.find(1, other, "MFCC", score));
+  assertEquals(1.0 / 3, score);
+  unlink(file.c_str());
+}
+
+// Sums of ranges split in halves down to single values, every level
+// waiting for the one below it
+long nestedSum(Scheduler& scheduler, long from, long to) {
+  if(to - from == 1)
+    return from;
+  auto middle = (from + to) / 2;
+  long left, right;
+  TaskGroup group(scheduler);
+  group.run([&] { left = nestedSum(scheduler, from, middle); });
+  right = nestedSum(scheduler, middle, to);
+  group.wait();
+  return left + right;
+}
+
+void testStructuredUpdate() {
+  TestCRF crf;
+  crf.label_alphabet = new TestAlphabet();
+  crf.lambda = {{1.0f}};
+  vector<int> x{0, 1, 2}, y{0, 1, 2}, yHat{3, 4, 5};
+
+  StructuredUpdate<TestCRF> update;
+  update.features = {0};
+  update.norms = {2};
+  update.rate = 0.5;
+  update.maxStep = 100;
+  update.lossScale = 1;
+  auto difference = [&](const Params& params) {
+    auto lambda = crf.lambda;
+    lambda[0] = params[0] / update.norms[0];
+    return concat_cost<TestCRF>(yHat, crf, lambda, x) - concat_cost<TestCRF>(y, crf, lambda, x);
+  };
+  auto length = [](const Params& d) { return std::sqrt((d * d).sum()); };
+
+  // yHat misses the input everywhere, it costs more with larger params
+  auto d = update.gradient(crf, yHat, y, x);
+  assertEquals(true, d[0] > 0);
+  Params params(1.0, 1);
+  assertNear(d[0] * params[0], difference(params), 1e-12);
+
+  update.margin = true;
+  auto loss = difference(params) + 2;
+  update.apply(params, d, difference(params), loss);
+  assertNear(loss, difference(params), 1e-12);
+  // Already ahead by the loss
+  auto before = params;
+  update.apply(params, d, difference(params), loss - 1);
+  assertEquals(before[0], params[0]);
+  update.maxStep = 0.01;
+  update.apply(params, d, difference(params), loss + 100);
+  assertNear(0.01 * length(d), length(params - before), 1e-12);
+
+  update.margin = false;
+  before = params;
+  update.apply(params, d, difference(params), loss);
+  assertNear(update.rate, length(params - before), 1e-12);
+  assertEquals(true, params[0] > before[0]);
+  // Towards yHat, not below 0
+  update.rate = 100;
+  update.apply(params, update.gradient(crf, y, yHat, x), 0, loss);
+  assertEquals(0.0, params[0]);
+
+  assertEquals(0.0, update.average()[0]);
+  update.add(Params(1.0, 1));
+  update.add(Params(2.0, 1));
+  update.add(Params(6.0, 1));
+  assertEquals(3.0, update.average()[0]);
+}
+
+void testScheduler() {
+  Scheduler scheduler(4);
+  assertEquals(4u, scheduler.size());
+  assertEquals(1000l * 999 / 2, nestedSum(scheduler, 0, 1000));
+
+  std::vector<unsigned> squares(100);
+  parallel_for(scheduler, 0, squares.size(), [&](unsigned i) { squares[i] = i * i; });
+  for(auto i = 0u; i < squares.size(); i++)
+    assertEquals(i * i, squares[i]);
+
+  auto result = scheduler.async([] { return 42; });
+  assertEquals(42, result.get());
+
+  TaskGroup group(scheduler);
+  group.run([] { throw std::runtime_error("failed"); });
+  std::string error;
+  try {
+    group.wait();
+  } catch(std::runtime_error& e) {
+    error = e.what();
+  }
+  assertEquals(std::string("failed"), error);
+}
+
+// The square of the number in the job followed by that many bytes, 0
+// crashes the process running it and 1 throws
+std::string squareJob(const std::string& job) {
+  MessageReader r(job);
+  auto x = r.get<uint32_t>();
+  if(x == 0)
+    abort();
+  if(x == 1)
+    throw std::runtime_error("one");
+  MessageWriter w;
+  w.put<uint64_t>((uint64_t) x * x);
+  w.data.append(x, 'x');
+  return w.data;
+}
+
+void testWorkers() {
+  MessageWriter w;
+  w.put<uint32_t>(7);
+  w.put(2.5);
+  w.put<char>(true);
+  MessageReader r(w.data);
+  assertEquals(7u, r.get<uint32_t>());
+  assertEquals(2.5, r.get<double>());
+  assertEquals('\1', r.get<char>());
+  assertEquals(w.data.size(), r.pos);
+
+  auto job = [](uint32_t x) {
+    MessageWriter w;
+    w.put(x);
+    return w.data;
+  };
+  auto check = [](uint32_t x, const std::string& reply) {
+    MessageReader r(reply);
+    assertEquals((uint64_t) x * x, r.get<uint64_t>());
+    assertEquals(std::string(x, 'x'), reply.substr(r.pos));
+  };
+
+  WorkerPool pool(2, [](const std::string& job) { return squareJob(job); });
+  assertEquals(2u, pool.size());
+  std::vector<std::string> replies;
+  // Larger than a socket buffer
+  auto status = pool.run({ job(3), job(1 << 20) }, &replies);
+  assertEquals(WorkerPool::DONE, status[0]);
+  assertEquals(WorkerPool::DONE, status[1]);
+  check(3, replies[0]);
+  check(1 << 20, replies[1]);
+
+  for(auto failing : { 0u, 1u }) {
+    status = pool.run({ job(failing), job(5) }, &replies);
+    assertEquals(WorkerPool::FAILED, status[0]);
+    assertEquals(std::string(), replies[0]);
+    assertEquals(WorkerPool::DONE, status[1]);
+    check(5, replies[1]);
+
+    // The same worker takes the next job
+    status = pool.run({ job(6) }, &replies);
+    assertEquals(WorkerPool::DONE, status[0]);
+    check(6, replies[0]);
+  }
+
+  status = pool.run({ job(2), job(3), job(4) }, &replies);
+  assertEquals(WorkerPool::LOST, status[2]);
+  assertEquals(2u, pool.size());
+
+  // Not forked with other threads running
+  Scheduler scheduler(2);
+  WorkerPool none(2, [](const std::string& job) { return squareJob(job); });
+  assertEquals(0u, none.size());
+  status = none.run({ job(3) }, &replies);
+  assertEquals(WorkerPool::LOST, status[0]);
+}
+
 bool Progress::enabled = true;
 int main() {
   try {
     testGridPrint();
+    testEarlyRejection();
+    testWaveBuilder();
+    testArena();
+    testMFCCExtractor();
+    testScoreCache();
+    testStructuredUpdate();
+    testScheduler();
+    testWorkers();
+    testIncrementalComparison();
+    testIncrementalResynthesis();
+    testAnalysisPrecision();
     testUtils();
     testCrfPathLength1();
     testCrfSecondBestPath();
+    testDecoderWorkspace();
+    testPosteriors();
     testCRF();
 
     std::cout << "All tests passed\n";